@@ -36,6 +36,8 @@
               wayland-protocols
               wlr-protocols
               stb
+              libjpeg
+              libpng
             ];
 
             cmakeFlags = [ "-DCMAKE_BUILD_TYPE=Release" ];
@@ -63,6 +65,8 @@
               wayland-protocols
               wlr-protocols
               stb
+              libjpeg
+              libpng
             ];
           };
       });
@@ -1,8 +1,5 @@
 #include "common.hpp"
-#include <cstdarg>
-#include <cstdio>
 #include <cstdlib>
-#include <ctime>
 #include <filesystem>
 #include <sys/stat.h>
 #include <unistd.h>
@@ -11,14 +8,18 @@ namespace fs = std::filesystem;
 
 namespace waul {
 
-static FILE *log_file = nullptr;
-
 void ensure_dir(const std::string &path) {
   if (!fs::exists(path)) {
     fs::create_directories(path);
   }
 }
 
+void hash_mix(uint64_t &h, const void *data, size_t len) {
+  const uint8_t *p = (const uint8_t *)data;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ p[i]) * 1099511628211ull;
+}
+
 std::string get_config_dir() {
   const char *cf = getenv("XDG_CONFIG_HOME");
   std::string path = cf ? std::string(cf) + "/waul"
@@ -43,58 +44,18 @@ std::string get_data_home_dir() {
   return path;
 }
 
-std::string get_runtime_dir() {
+std::string get_runtime_dir(bool create) {
   const char *rd = getenv("XDG_RUNTIME_DIR");
   if (!rd)
     return "/tmp";
   std::string path = std::string(rd) + "/waul";
-  ensure_dir(path);
+  if (create)
+    ensure_dir(path);
   return path;
 }
 
-std::string get_socket_path() { return get_runtime_dir() + "/waul.sock"; }
-
-void log_init() {
-  std::string path = get_data_home_dir() + "/waul.log";
-  log_file = fopen(path.c_str(), "a");
-}
-
-void log_msg(LogLevel level, const char *fmt, ...) {
-  if (!log_file)
-    return;
-
-  time_t now = time(nullptr);
-  char tbuf[20];
-  strftime(tbuf, sizeof(tbuf), "%Y-%m-%d %H:%M:%S", localtime(&now));
-
-  const char *tag = "[UNK]";
-  switch (level) {
-  case DEBUG:
-    tag = "[DBG]";
-    break;
-  case INFO:
-    tag = "[INF]";
-    break;
-  case SUCCESS:
-    tag = "[OK ]";
-    break;
-  case WARN:
-    tag = "[WRN]";
-    break;
-  case ERROR:
-    tag = "[ERR]";
-    break;
-  }
-
-  fprintf(log_file, "%s %s ", tbuf, tag);
-
-  va_list args;
-  va_start(args, fmt);
-  vfprintf(log_file, fmt, args);
-  va_end(args);
-
-  fprintf(log_file, "\n");
-  fflush(log_file);
+std::string get_socket_path(bool create) {
+  return get_runtime_dir(create) + "/waul.sock";
 }
 
 } // namespace waul
\ No newline at end of file
@@ -1,4 +1,7 @@
 #pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -6,14 +9,41 @@ namespace waul {
 
 enum LogLevel { DEBUG, INFO, SUCCESS, WARN, ERROR };
 
+// Lowest level built in, set by -DWAUL_LOG_LEVEL
+#ifndef WAUL_LOG_MIN
+#define WAUL_LOG_MIN 0
+#endif
+
+// Lowest level written, from log_level in config.ini
+extern std::atomic<int> log_threshold;
+
+// Starts the writer thread on waul.log; until then nothing is logged
 void log_init();
-void log_msg(LogLevel level, const char *fmt, ...);
+// Applies the log_* config keys
+void log_configure(LogLevel level, int flush_interval_ms, int limit_mb);
+void log_write(LogLevel level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+// Levels below WAUL_LOG_MIN compile away with their arguments; below
+// log_threshold they cost a load and a branch
+#define log_msg(level, ...)                                                    \
+  do {                                                                         \
+    if ((level) >= WAUL_LOG_MIN &&                                             \
+        (level) >= ::waul::log_threshold.load(std::memory_order_relaxed))     \
+      ::waul::log_write(level, __VA_ARGS__);                                   \
+  } while (0)
 
 std::string get_config_dir();
 std::string get_cache_dir();
 std::string get_data_home_dir();
-std::string get_runtime_dir();
-std::string get_socket_path();
+// create=false only builds the path, for clients that must not touch the
+// filesystem before connecting
+std::string get_runtime_dir(bool create = true);
+std::string get_socket_path(bool create = true);
 void ensure_dir(const std::string &path);
 
+// FNV-1a, for cache keys and change detection
+constexpr uint64_t HASH_SEED = 1469598103934665603ull;
+void hash_mix(uint64_t &h, const void *data, size_t len);
+
 } // namespace waul
\ No newline at end of file
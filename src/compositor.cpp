@@ -0,0 +1,638 @@
+#include "compositor.hpp"
+#include "common.hpp"
+#include "decoder.hpp"
+#include "pixel_ops.hpp"
+#include "scaler.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <vector>
+
+namespace waul {
+
+static uint32_t mix_alpha(int r, int g, int b, int a, uint32_t bg) {
+  uint32_t c = (0xFF << 24) | (r << 16) | (g << 8) | b;
+  return blend_px(bg, c, cov_weight(a));
+}
+
+static void fill_span(uint32_t *row, int x0, int x1, uint32_t color) {
+  if (x0 < x1)
+    pixel_ops().fill(row + x0, color, x1 - x0);
+}
+
+// Blends the n pixels starting at bx with cov, clipped to [x0, x1).
+static void blend_span(uint32_t *row, int bx, int n, int x0, int x1,
+                       uint32_t color, const uint8_t *cov) {
+  int s = std::max(bx, x0), e = std::min(bx + n, x1);
+  if (s < e)
+    pixel_ops().blend(row + s, color, cov + (s - bx), e - s);
+}
+
+static uint8_t quantize(float t) { return (uint8_t)(t * 255.0f + 0.5f); }
+
+// Anti-aliased coverage of one corner box row, left to right on screen. dy is
+// the row's distance from the circle centre. inner is the weight of the
+// border over the content, outer the weight of the background over that.
+// Only used to build CornerMask rows, never per frame.
+static void corner_coverage(int rad, int bw, float dy, bool left,
+                            uint8_t *inner, uint8_t *outer) {
+  int inner_rad = std::max(0, rad - bw);
+  for (int i = 0; i < rad; i++) {
+    float dx = left ? rad - i - 0.5f : i + 0.5f;
+    float dist = sqrt(dx * dx + dy * dy) - 0.5f;
+
+    if (dist > rad)
+      outer[i] = 255;
+    else if (dist > rad - 1.0f)
+      outer[i] = quantize(dist - (rad - 1.0f));
+    else
+      outer[i] = 0;
+
+    if (dist > rad - 1.0f || dist > inner_rad)
+      inner[i] = 255;
+    else if (dist > inner_rad - 1.0f)
+      inner[i] = quantize(dist - (inner_rad - 1.0f));
+    else
+      inner[i] = 0;
+  }
+}
+
+// Coverage of a rad x rad corner box for one (radius, border width) pair.
+// Row j is the box row whose centre is j + 0.5 from the circle centre;
+// left and right boxes are stored pre-mirrored so rows apply left to right.
+struct CornerMask {
+  int rad = 0, bw = 0;
+  std::vector<uint8_t> planes;
+
+  const uint8_t *inner(bool left, int j) const {
+    return &planes[((left ? 0 : 2) * rad + j) * rad];
+  }
+  const uint8_t *outer(bool left, int j) const {
+    return &planes[((left ? 1 : 3) * rad + j) * rad];
+  }
+};
+
+// A deque keeps mask pointers valid while other frames add entries
+static std::deque<CornerMask> mask_cache;
+static uint64_t mask_layout = 0;
+static bool mask_layout_valid = false;
+
+static void build_mask(CornerMask &m) {
+  m.planes.resize((size_t)4 * m.rad * m.rad);
+  for (int j = 0; j < m.rad; j++) {
+    float dy = j + 0.5f;
+    corner_coverage(m.rad, m.bw, dy, true, (uint8_t *)m.inner(true, j),
+                    (uint8_t *)m.outer(true, j));
+    corner_coverage(m.rad, m.bw, dy, false, (uint8_t *)m.inner(false, j),
+                    (uint8_t *)m.outer(false, j));
+  }
+  log_msg(DEBUG, "Built corner mask r=%d bw=%d", m.rad, m.bw);
+}
+
+// Resolves the masks of the four corners, building missing ones. The cache
+// is dropped whenever the layout differs from the one it was built for;
+// colors never affect coverage.
+static void prepare_masks(const ConfigState &cfg, const int rad[4],
+                          const int bw[4], const CornerMask *out[4]) {
+  uint64_t layout = Config::layout_hash(cfg);
+  if (!mask_layout_valid || layout != mask_layout) {
+    mask_cache.clear();
+    mask_layout = layout;
+    mask_layout_valid = true;
+  }
+
+  auto find = [](int r, int b) -> const CornerMask * {
+    for (const auto &m : mask_cache)
+      if (m.rad == r && m.bw == b)
+        return &m;
+    return nullptr;
+  };
+
+  for (int i = 0; i < 4; i++) {
+    if (rad[i] > 0 && !find(rad[i], bw[i])) {
+      mask_cache.emplace_back();
+      mask_cache.back().rad = rad[i];
+      mask_cache.back().bw = bw[i];
+      build_mask(mask_cache.back());
+    }
+  }
+  for (int i = 0; i < 4; i++)
+    out[i] = rad[i] > 0 ? find(rad[i], bw[i]) : nullptr;
+}
+
+// Where the image comes from for a row: nowhere, the scaler, the source
+// row as is (placed at its own size), or the source row repeated (tile).
+enum Source { SRC_NONE, SRC_SCALE, SRC_COPY, SRC_TILE };
+
+struct Plan;
+typedef void (*RowsFn)(const Plan &p, int ya, int yb, ScalerScratch &scratch);
+
+// Everything a band needs to composite its rows, resolved once per frame.
+struct Plan {
+  Frame frame;
+  uint32_t bg_color, border_color;
+  int cx, cy, cw, ch;
+  int x0, x1, y0, y1;             // Content area clipped to the frame
+  int in_x0, in_x1, in_y0, in_y1; // Inside the border, empty without image
+  int img_x0, img_x1, img_y0, img_y1; // Image pixels, within the inner rect
+  int rad[4];
+  const CornerMask *mask[4];
+  const Image *img;
+  Source src;
+  int ox, oy; // Where the image's top left lands (scaled for SRC_SCALE)
+  Scaler scaler;
+  Underlay *under; // Capture target, may be null
+  RowsFn rows;     // composite_rows instance for this geometry
+  int band_rows;
+};
+
+// Corner box of one side crossing content row ry, if any: TL or BL on the
+// left, TR or BR on the right. Returns its index and sets the mask row.
+static int corner_at(const Plan &p, int ry, bool left, int &j) {
+  int top = left ? 0 : 1, bottom = left ? 3 : 2;
+  if (ry < p.rad[top]) {
+    j = p.rad[top] - 1 - ry;
+    return top;
+  }
+  if (ry >= p.ch - p.rad[bottom]) {
+    j = ry - (p.ch - p.rad[bottom]);
+    return bottom;
+  }
+  return -1;
+}
+
+static int corner_x(const Plan &p, int c) {
+  return c == 0 || c == 3 ? p.cx : p.cx + p.cw - p.rad[c];
+}
+
+static void blend_corner(const Plan &p, uint32_t *row, int c, int j) {
+  const CornerMask *m = p.mask[c];
+  bool left = c == 0 || c == 3;
+  int bx = corner_x(p, c);
+  blend_span(row, bx, m->rad, p.x0, p.x1, p.border_color, m->inner(left, j));
+  blend_span(row, bx, m->rad, p.x0, p.x1, p.bg_color, m->outer(left, j));
+}
+
+// Saves a corner box row before blending. Image pixels have their alpha
+// byte set; the others are stored as 0 if border filled and 1 if they were
+// background around the image (contain, center).
+static void capture_corner(const Plan &p, const uint32_t *row, int y, int c,
+                           int j) {
+  int rad = p.rad[c], bx = corner_x(p, c);
+  uint32_t *dst = p.under->corner[c].data() + (size_t)j * rad;
+  bool img_row = y >= p.img_y0 && y < p.img_y1;
+  bool in_row = y >= p.in_y0 && y < p.in_y1;
+  int s = std::max(bx, p.x0), e = std::min(bx + rad, p.x1);
+  for (int x = s; x < e; x++) {
+    if (img_row && x >= p.img_x0 && x < p.img_x1)
+      dst[x - bx] = row[x];
+    else
+      dst[x - bx] = in_row && x >= p.in_x0 && x < p.in_x1;
+  }
+}
+
+// Writes row[img_x0 .. img_x1) for frame row y
+template <Source S>
+static void image_row(const Plan &p, int y, uint32_t *row,
+                      ScalerScratch &scratch) {
+  const Image &img = *p.img;
+  if constexpr (S == SRC_SCALE) {
+    p.scaler.row(y, row, scratch);
+  } else if constexpr (S == SRC_COPY) {
+    const uint32_t *src =
+        img.pixels + (size_t)(y - p.oy) * img.w + (p.img_x0 - p.ox);
+    memcpy(row + p.img_x0, src, (size_t)(p.img_x1 - p.img_x0) * 4);
+  } else if constexpr (S == SRC_TILE) {
+    int sy = (y - p.oy) % img.h;
+    const uint32_t *src = img.pixels + (size_t)sy * img.w;
+    int sx = (p.img_x0 - p.ox) % img.w;
+    for (int x = p.img_x0; x < p.img_x1;) {
+      int n = std::min(img.w - sx, p.img_x1 - x);
+      memcpy(row + x, src + sx, (size_t)n * 4);
+      x += n;
+      sx = 0;
+    }
+  } else {
+    (void)img, (void)y, (void)row, (void)scratch;
+  }
+}
+
+// Rows are classified once: margin rows are filled in bulk, content rows are
+// written as left margin | border | background | image | background | border
+// | right margin spans, and only the boxes of the corners crossing the row
+// are blended with masks. Edges is false when the image covers the whole
+// frame, which leaves just the image row; without Corners no row looks for
+// corner boxes. plan_frame() picks the instance once per frame.
+template <Source S, bool Edges, bool Corners>
+static void composite_rows(const Plan &p, int ya, int yb,
+                           ScalerScratch &scratch) {
+  const Frame &frame = p.frame;
+
+  for (int y = ya; y < yb; y++) {
+    uint32_t *row = frame.pixels + (size_t)y * frame.stride;
+
+    if constexpr (Edges) {
+      if (y < p.y0 || y >= p.y1) {
+        fill_span(row, 0, frame.w, p.bg_color);
+        continue;
+      }
+
+      fill_span(row, 0, p.x0, p.bg_color);
+      fill_span(row, p.x1, frame.w, p.bg_color);
+
+      if (y < p.in_y0 || y >= p.in_y1) {
+        fill_span(row, p.x0, p.x1, p.border_color);
+      } else {
+        fill_span(row, p.x0, p.in_x0, p.border_color);
+        fill_span(row, p.in_x1, p.x1, p.border_color);
+        if (y < p.img_y0 || y >= p.img_y1) {
+          fill_span(row, p.in_x0, p.in_x1, p.bg_color);
+        } else {
+          fill_span(row, p.in_x0, p.img_x0, p.bg_color);
+          fill_span(row, p.img_x1, p.in_x1, p.bg_color);
+          image_row<S>(p, y, row, scratch);
+        }
+      }
+    } else {
+      image_row<S>(p, y, row, scratch);
+    }
+
+    if constexpr (Corners) {
+      int ry = y - p.cy;
+      for (int side = 0; side < 2; side++) {
+        int j, c = corner_at(p, ry, side == 0, j);
+        if (c < 0)
+          continue;
+        if (p.under)
+          capture_corner(p, row, y, c, j);
+        blend_corner(p, row, c, j);
+      }
+    }
+  }
+}
+
+template <Source S>
+static RowsFn pick_rows(bool edges, bool corners) {
+  if (edges)
+    return corners ? composite_rows<S, true, true>
+                   : composite_rows<S, true, false>;
+  return corners ? composite_rows<S, false, true>
+                 : composite_rows<S, false, false>;
+}
+
+static RowsFn pick_rows(Source src, bool edges, bool corners) {
+  switch (src) {
+  case SRC_SCALE:
+    return pick_rows<SRC_SCALE>(edges, corners);
+  case SRC_COPY:
+    return pick_rows<SRC_COPY>(edges, corners);
+  case SRC_TILE:
+    return pick_rows<SRC_TILE>(edges, corners);
+  default:
+    return pick_rows<SRC_NONE>(true, corners);
+  }
+}
+
+// Bands of every frame of one composite() call, numbered consecutively.
+struct Job {
+  std::vector<Plan> plans;
+  std::vector<int> first_band;
+  const std::atomic<bool> *cancel;
+};
+
+static void composite_band(void *ctx, int band) {
+  const Job &job = *(const Job *)ctx;
+  if (job.cancel && job.cancel->load(std::memory_order_relaxed))
+    return;
+  WAUL_TRACE_SCOPE("band");
+  size_t k = 0;
+  while (k + 1 < job.plans.size() && band >= job.first_band[k + 1])
+    k++;
+  const Plan &p = job.plans[k];
+  int ya = (band - job.first_band[k]) * p.band_rows;
+  int yb = std::min(ya + p.band_rows, p.frame.h);
+  ScalerScratch scratch;
+  p.rows(p, ya, yb, scratch);
+}
+
+// Size the image is drawn at inside an inner_w x inner_h box
+static void fit_size(const Image &img, Fit fit, int inner_w, int inner_h,
+                     int &sw, int &sh) {
+  if (fit == FIT_STRETCH) {
+    sw = inner_w;
+    sh = inner_h;
+  } else if (fit == FIT_COVER || fit == FIT_CONTAIN) {
+    float sx = (float)inner_w / img.w, sy = (float)inner_h / img.h;
+    float scale = fit == FIT_COVER ? std::max(sx, sy) : std::min(sx, sy);
+    sw = std::max(1, (int)lroundf(img.w * scale));
+    sh = std::max(1, (int)lroundf(img.h * scale));
+    // Cover never leaves a rounding gap along the fitted axis, contain never
+    // overflows it
+    if (fit == FIT_COVER) {
+      sw = std::max(inner_w, sw);
+      sh = std::max(inner_h, sh);
+    } else {
+      sw = std::min(inner_w, sw);
+      sh = std::min(inner_h, sh);
+    }
+  } else {
+    sw = img.w;
+    sh = img.h;
+  }
+}
+
+static void plan_frame(Plan &p, const Frame &frame, const Image *img,
+                       const ConfigState &cfg) {
+  p.frame = frame;
+  p.bg_color = (0xFF << 24) | (cfg.bg[0] << 16) | (cfg.bg[1] << 8) | cfg.bg[2];
+  p.border_color =
+      (0xFF << 24) | (cfg.bc[0] << 16) | (cfg.bc[1] << 8) | cfg.bc[2];
+  if (cfg.bc[3] < 255)
+    p.border_color =
+        mix_alpha(cfg.bc[0], cfg.bc[1], cfg.bc[2], cfg.bc[3], p.bg_color);
+
+  int cx = p.cx = cfg.m[1];
+  int cy = p.cy = cfg.m[0];
+  int cw = p.cw = frame.w - cfg.m[1] - cfg.m[3];
+  int ch = p.ch = frame.h - cfg.m[0] - cfg.m[2];
+  p.img = nullptr;
+  p.src = SRC_NONE;
+  p.under = nullptr;
+  for (int i = 0; i < 4; i++) {
+    p.rad[i] = 0;
+    p.mask[i] = nullptr;
+  }
+
+  p.x0 = std::clamp(cx, 0, frame.w);
+  p.x1 = std::clamp(cx + cw, 0, frame.w);
+  p.y0 = std::clamp(cy, 0, frame.h);
+  p.y1 = std::clamp(cy + ch, 0, frame.h);
+  p.in_x0 = p.in_x1 = p.in_y0 = p.in_y1 = 0;
+  p.img_x0 = p.img_x1 = p.img_y0 = p.img_y1 = 0;
+  p.rows = pick_rows(SRC_NONE, true, false);
+  if (p.x0 >= p.x1 || p.y0 >= p.y1) {
+    // Margins swallow the whole frame
+    p.y0 = p.y1 = 0;
+    return;
+  }
+
+  // Radii larger than half the content box would make corners overlap
+  for (int i = 0; i < 4; i++)
+    p.rad[i] = std::clamp(cfg.br[i], 0, std::min(cw, ch) / 2);
+
+  // Border width each corner's ring is drawn with: TL, TR, BR, BL
+  int cbw[4] = {std::max(cfg.bw[0], cfg.bw[1]), std::max(cfg.bw[0], cfg.bw[3]),
+                std::max(cfg.bw[2], cfg.bw[3]), std::max(cfg.bw[2], cfg.bw[1])};
+  prepare_masks(cfg, p.rad, cbw, p.mask);
+  bool corners = p.mask[0] || p.mask[1] || p.mask[2] || p.mask[3];
+
+  bool has_img = img && img->pixels && img->w > 0 && img->h > 0;
+  if (has_img) {
+    // Area inside the border, clipped to the content area
+    p.in_x0 = std::clamp(cx + cfg.bw[1], p.x0, p.x1);
+    p.in_x1 = std::clamp(cx + cw - cfg.bw[3], p.in_x0, p.x1);
+    p.in_y0 = std::clamp(cy + cfg.bw[0], p.y0, p.y1);
+    p.in_y1 = std::clamp(cy + ch - cfg.bw[2], p.in_y0, p.y1);
+
+    int inner_w = cw - cfg.bw[1] - cfg.bw[3];
+    int inner_h = ch - cfg.bw[0] - cfg.bw[2];
+    int sw, sh;
+    fit_size(*img, cfg.fit, inner_w, inner_h, sw, sh);
+    p.img = img;
+    if (cfg.fit == FIT_TILE) {
+      p.ox = cx + cfg.bw[1];
+      p.oy = cy + cfg.bw[0];
+      p.src = SRC_TILE;
+      p.img_x0 = p.in_x0;
+      p.img_x1 = p.in_x1;
+      p.img_y0 = p.in_y0;
+      p.img_y1 = p.in_y1;
+    } else {
+      p.ox = cx + cfg.bw[1] + (inner_w - sw) / 2;
+      p.oy = cy + cfg.bw[0] + (inner_h - sh) / 2;
+      p.src = sw == img->w && sh == img->h ? SRC_COPY : SRC_SCALE;
+      p.img_x0 = std::clamp(p.ox, p.in_x0, p.in_x1);
+      p.img_x1 = std::clamp(p.ox + sw, p.img_x0, p.in_x1);
+      p.img_y0 = std::clamp(p.oy, p.in_y0, p.in_y1);
+      p.img_y1 = std::clamp(p.oy + sh, p.img_y0, p.in_y1);
+      if (p.src == SRC_SCALE)
+        p.scaler.setup(*img, cfg.filter, p.ox, p.oy, sw, sh, p.img_x0,
+                       p.img_x1);
+    }
+    if (p.img_x0 >= p.img_x1 || p.img_y0 >= p.img_y1)
+      p.img_x0 = p.img_x1 = p.img_y0 = p.img_y1 = 0;
+  }
+
+  bool edges = p.img_x0 > 0 || p.img_x1 < frame.w || p.img_y0 > 0 ||
+               p.img_y1 < frame.h;
+  p.rows = pick_rows(p.src, edges, corners);
+}
+
+// Points p at u and records where the image lands in p's frame.
+static void prepare_underlay(Plan &p, Underlay &u) {
+  p.under = &u;
+  u = Underlay();
+  u.in_x0 = p.in_x0;
+  u.in_x1 = p.in_x1;
+  u.in_y0 = p.in_y0;
+  u.in_y1 = p.in_y1;
+  u.img_x0 = p.img_x0;
+  u.img_x1 = p.img_x1;
+  u.img_y0 = p.img_y0;
+  u.img_y1 = p.img_y1;
+  for (int c = 0; c < 4; c++)
+    u.corner[c].assign((size_t)p.rad[c] * p.rad[c], 0);
+}
+
+void composite(const Frame *frames, int count, const Image *img,
+               const ConfigState &cfg, Underlay *const *underlays,
+               const std::atomic<bool> *cancel) {
+  WAUL_TRACE_SCOPE("composite");
+  ThreadPool::resize(cfg.threads);
+
+  Job job;
+  job.cancel = cancel;
+  job.plans.resize(count);
+  job.first_band.resize(count);
+  int bands = 0;
+  for (int i = 0; i < count; i++) {
+    Plan &p = job.plans[i];
+    plan_frame(p, frames[i], img, cfg);
+    if (underlays && underlays[i])
+      prepare_underlay(p, *underlays[i]);
+
+    // A few bands per thread so uneven rows (corners, area boxes) balance
+    int n = std::max(1, std::min(frames[i].h, ThreadPool::size() * 4));
+    p.band_rows = std::max(1, (frames[i].h + n - 1) / n);
+    job.first_band[i] = bands;
+    bands += (frames[i].h + p.band_rows - 1) / p.band_rows;
+  }
+  ThreadPool::run(bands, composite_band, &job);
+}
+
+void composite(const Frame &frame, const Image *img, const ConfigState &cfg) {
+  composite(&frame, 1, img, cfg);
+}
+
+// composite_rows over rect r with the image pixels left as they are and the
+// corner boxes rebuilt from the underlay. A corner box crossing r is redone
+// whole, which writes the same values outside r.
+static void recolor_rows(const Plan &p, const Underlay &u, const Rect &r) {
+  const Frame &frame = p.frame;
+  int xl = std::max(r.x, 0), xh = std::min(r.x + r.w, frame.w);
+  auto fill = [&](uint32_t *row, int x0, int x1, uint32_t color) {
+    fill_span(row, std::max(x0, xl), std::min(x1, xh), color);
+  };
+  for (int y = std::max(r.y, 0), ye = std::min(r.y + r.h, frame.h); y < ye;
+       y++) {
+    uint32_t *row = frame.pixels + (size_t)y * frame.stride;
+
+    if (y < p.y0 || y >= p.y1) {
+      fill(row, 0, frame.w, p.bg_color);
+      continue;
+    }
+
+    fill(row, 0, p.x0, p.bg_color);
+    fill(row, p.x1, frame.w, p.bg_color);
+
+    if (y < u.in_y0 || y >= u.in_y1) {
+      fill(row, p.x0, p.x1, p.border_color);
+    } else {
+      fill(row, p.x0, u.in_x0, p.border_color);
+      fill(row, u.in_x1, p.x1, p.border_color);
+      if (y < u.img_y0 || y >= u.img_y1) {
+        fill(row, u.in_x0, u.in_x1, p.bg_color);
+      } else {
+        fill(row, u.in_x0, u.img_x0, p.bg_color);
+        fill(row, u.img_x1, u.in_x1, p.bg_color);
+      }
+    }
+
+    int ry = y - p.cy;
+    for (int side = 0; side < 2; side++) {
+      int j, c = corner_at(p, ry, side == 0, j);
+      if (c < 0)
+        continue;
+      int rad = p.rad[c], bx = corner_x(p, c);
+      if (bx + rad <= xl || bx >= xh)
+        continue;
+      const uint32_t *src = u.corner[c].data() + (size_t)j * rad;
+      for (int x = std::max(bx, p.x0), e = std::min(bx + rad, p.x1); x < e;
+           x++) {
+        uint32_t v = src[x - bx];
+        row[x] = v > 1 ? v : v ? p.bg_color : p.border_color;
+      }
+      blend_corner(p, row, c, j);
+    }
+  }
+}
+
+void recolor(const Frame &frame, const ConfigState &cfg, const Underlay &u,
+             const Rect *rects, int n) {
+  WAUL_TRACE_SCOPE("recolor");
+  Plan p;
+  plan_frame(p, frame, nullptr, cfg);
+  if (n == 0)
+    recolor_rows(p, u, Rect{0, 0, frame.w, frame.h});
+  for (int i = 0; i < n; i++)
+    recolor_rows(p, u, rects[i]);
+}
+
+static void add_rect(Rect *out, int &n, int x0, int y0, int x1, int y1) {
+  if (x0 < x1 && y0 < y1)
+    out[n++] = Rect{x0, y0, x1 - x0, y1 - y0};
+}
+
+int recolor_damage(const Frame &frame, const ConfigState &from,
+                   const ConfigState &cfg, const Underlay &u, Rect *out) {
+  Plan a, b;
+  plan_frame(a, frame, nullptr, from);
+  plan_frame(b, frame, nullptr, cfg);
+  bool bg = a.bg_color != b.bg_color;
+  bool border = a.border_color != b.border_color;
+  int n = 0;
+
+  if (bg) {
+    add_rect(out, n, 0, 0, frame.w, b.y0);
+    add_rect(out, n, 0, b.y1, frame.w, frame.h);
+    add_rect(out, n, 0, b.y0, b.x0, b.y1);
+    add_rect(out, n, b.x1, b.y0, frame.w, b.y1);
+  }
+  if (bg && u.img_x0 < u.img_x1) {
+    // Bars around a contained or centered image
+    add_rect(out, n, u.in_x0, u.in_y0, u.in_x1, u.img_y0);
+    add_rect(out, n, u.in_x0, u.img_y1, u.in_x1, u.in_y1);
+    add_rect(out, n, u.in_x0, u.img_y0, u.img_x0, u.img_y1);
+    add_rect(out, n, u.img_x1, u.img_y0, u.in_x1, u.img_y1);
+  } else if (bg) {
+    // No image pixels: the bars are the whole inner rect
+    add_rect(out, n, u.in_x0, u.in_y0, u.in_x1, u.in_y1);
+  }
+  if (border) {
+    if (u.in_x0 < u.in_x1) {
+      add_rect(out, n, b.x0, b.y0, b.x1, u.in_y0);
+      add_rect(out, n, b.x0, u.in_y1, b.x1, b.y1);
+      add_rect(out, n, b.x0, u.in_y0, u.in_x0, u.in_y1);
+      add_rect(out, n, u.in_x1, u.in_y0, b.x1, u.in_y1);
+    } else {
+      add_rect(out, n, b.x0, b.y0, b.x1, b.y1);
+    }
+  }
+  if (bg || border) {
+    int top = b.y0, bottom = b.y1;
+    for (int c = 0; c < 4; c++) {
+      int bx = corner_x(b, c), by = c < 2 ? b.cy : b.cy + b.ch - b.rad[c];
+      add_rect(out, n, std::max(bx, b.x0), std::max(by, top),
+               std::min(bx + b.rad[c], b.x1), std::min(by + b.rad[c], bottom));
+    }
+  }
+  return n;
+}
+
+int render_to_file(const std::string &path, int w, int h,
+                   const ConfigState &cfg, const std::string &out,
+                   double *elapsed_ms) {
+  Image img;
+  // Center and tile draw the image at its own size, so decode all of it
+  bool native = cfg.fit == FIT_CENTER || cfg.fit == FIT_TILE;
+  if (!path.empty() &&
+      !image_load(path, img, native ? 0 : w, native ? 0 : h))
+    return 1;
+
+  std::vector<uint32_t> pixels((size_t)w * h);
+  Frame frame{pixels.data(), w, h, w};
+
+  auto t0 = std::chrono::steady_clock::now();
+  composite(frame, img.pixels ? &img : nullptr, cfg);
+  auto t1 = std::chrono::steady_clock::now();
+  if (elapsed_ms)
+    *elapsed_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+  image_free(img);
+
+  FILE *f = fopen(out.c_str(), "wb");
+  if (!f) {
+    log_msg(ERROR, "Cannot open %s for writing", out.c_str());
+    return 1;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", w, h);
+  std::vector<uint8_t> row((size_t)w * 3);
+  for (int y = 0; y < h; y++) {
+    const uint32_t *p = &pixels[(size_t)y * w];
+    for (int x = 0; x < w; x++) {
+      row[x * 3] = (p[x] >> 16) & 0xFF;
+      row[x * 3 + 1] = (p[x] >> 8) & 0xFF;
+      row[x * 3 + 2] = p[x] & 0xFF;
+    }
+    fwrite(row.data(), 1, row.size(), f);
+  }
+  fclose(f);
+  return 0;
+}
+
+} // namespace waul
@@ -0,0 +1,64 @@
+#pragma once
+#include "config.hpp"
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace waul {
+
+// Decoded source image, converted to XRGB8888 on load.
+struct Image {
+  uint32_t *pixels = nullptr;
+  int w = 0, h = 0;
+};
+
+// Caller-owned XRGB8888 destination. Stride is in pixels.
+struct Frame {
+  uint32_t *pixels = nullptr;
+  int w = 0, h = 0;
+  int stride = 0;
+};
+
+struct Rect {
+  int x, y, w, h;
+};
+
+// What recolor() needs to redo a frame's decoration without the image: the
+// rect inside the border, the rect the image covers within it and the corner
+// box pixels before blending, with border filled ones stored as 0 and
+// background ones as 1.
+struct Underlay {
+  int in_x0 = 0, in_x1 = 0, in_y0 = 0, in_y1 = 0;
+  int img_x0 = 0, img_x1 = 0, img_y0 = 0, img_y1 = 0;
+  std::vector<uint32_t> corner[4]; // TL, TR, BR, BL, rad x rad each
+};
+
+// Composites margins, border, rounded corners and the scaled image into
+// frame. img may be null, in which case the content area is border colored.
+void composite(const Frame &frame, const Image *img, const ConfigState &cfg);
+// Composites the same image into several frames of any size in one pass
+// over the thread pool. underlays, if given, holds one capture target (or
+// null) per frame. Once *cancel is set, bands not yet started are skipped
+// and the frames are left partly drawn.
+void composite(const Frame *frames, int count, const Image *img,
+               const ConfigState &cfg, Underlay *const *underlays = nullptr,
+               const std::atomic<bool> *cancel = nullptr);
+
+// Repaints margins, border and corners of a frame composited with u captured
+// for a config with the same layout as cfg, within the n rects given or all
+// of it if n is 0. Image pixels are not touched.
+void recolor(const Frame &frame, const ConfigState &cfg, const Underlay &u,
+             const Rect *rects = nullptr, int n = 0);
+// Rects that differ between such a frame recolored for from and for cfg.
+// Writes at most 16.
+int recolor_damage(const Frame &frame, const ConfigState &from,
+                   const ConfigState &cfg, const Underlay &u, Rect *out);
+
+// Headless path: renders path at w x h with cfg and writes a binary PPM.
+// Returns 0 on success.
+int render_to_file(const std::string &path, int w, int h,
+                   const ConfigState &cfg, const std::string &out,
+                   double *elapsed_ms = nullptr);
+
+} // namespace waul
@@ -1,17 +1,128 @@
 #include "config.hpp"
 #include "common.hpp"
+#include "trace.hpp"
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <sstream>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 namespace waul {
 
 ConfigState Config::state;
+bool Config::loaded = false;
 
 ConfigState &Config::get() { return state; }
 
 std::string Config::get_path() { return get_config_dir() + "/config.ini"; }
 
+uint64_t Config::layout_hash(const ConfigState &s) {
+  uint64_t h = HASH_SEED;
+  hash_mix(h, s.m, sizeof(s.m));
+  hash_mix(h, s.bw, sizeof(s.bw));
+  hash_mix(h, s.br, sizeof(s.br));
+  hash_mix(h, &s.filter, sizeof(s.filter));
+  hash_mix(h, &s.fit, sizeof(s.fit));
+  return h;
+}
+
+uint64_t Config::hash(const ConfigState &s) {
+  uint64_t h = layout_hash(s);
+  hash_mix(h, s.bc, sizeof(s.bc));
+  hash_mix(h, s.bg, sizeof(s.bg));
+  return h;
+}
+
+static void parse_filter(char *str, Filter &out) {
+  char *v = strtok(str, " \t\r\n");
+  if (!v)
+    return;
+  if (strcmp(v, "nearest") == 0)
+    out = FILTER_NEAREST;
+  else if (strcmp(v, "bilinear") == 0)
+    out = FILTER_BILINEAR;
+  else if (strcmp(v, "area") == 0)
+    out = FILTER_AREA;
+  else
+    log_msg(WARN, "Unknown filter '%s', keeping default", v);
+}
+
+static void parse_fit(char *str, Fit &out) {
+  char *v = strtok(str, " \t\r\n");
+  if (!v)
+    return;
+  if (strcmp(v, "cover") == 0)
+    out = FIT_COVER;
+  else if (strcmp(v, "contain") == 0)
+    out = FIT_CONTAIN;
+  else if (strcmp(v, "center") == 0)
+    out = FIT_CENTER;
+  else if (strcmp(v, "tile") == 0)
+    out = FIT_TILE;
+  else if (strcmp(v, "stretch") == 0)
+    out = FIT_STRETCH;
+  else
+    log_msg(WARN, "Unknown fit '%s', keeping default", v);
+}
+
+// Whole value, trimmed, with a leading ~ expanded
+static void parse_path(char *str, std::string &out) {
+  while (*str == ' ' || *str == '\t')
+    str++;
+  char *end = str + strlen(str);
+  while (end > str && strchr(" \t\r\n", end[-1]))
+    *--end = 0;
+  out = str;
+  const char *home = getenv("HOME");
+  if (home && out[0] == '~' && (out[1] == '/' || out[1] == 0))
+    out = home + out.substr(1);
+}
+
+static void parse_export(char *str, ExportMode &out) {
+  char *v = strtok(str, " \t\r\n");
+  if (!v)
+    return;
+  if (strcmp(v, "copy") == 0)
+    out = EXPORT_COPY;
+  else if (strcmp(v, "hardlink") == 0)
+    out = EXPORT_HARDLINK;
+  else if (strcmp(v, "symlink") == 0)
+    out = EXPORT_SYMLINK;
+  else if (strcmp(v, "none") == 0)
+    out = EXPORT_NONE;
+  else
+    log_msg(WARN, "Unknown current_wall mode '%s', keeping default", v);
+}
+
+static void parse_order(char *str, bool &shuffle) {
+  char *v = strtok(str, " \t\r\n");
+  if (!v)
+    return;
+  if (strcmp(v, "shuffle") == 0)
+    shuffle = true;
+  else if (strcmp(v, "sequential") == 0)
+    shuffle = false;
+  else
+    log_msg(WARN, "Unknown slideshow order '%s', keeping default", v);
+}
+
+static void parse_log_level(char *str, LogLevel &out) {
+  char *v = strtok(str, " \t\r\n");
+  if (!v)
+    return;
+  if (strcmp(v, "debug") == 0)
+    out = DEBUG;
+  else if (strcmp(v, "info") == 0)
+    out = INFO;
+  else if (strcmp(v, "warn") == 0)
+    out = WARN;
+  else if (strcmp(v, "error") == 0)
+    out = ERROR;
+  else
+    log_msg(WARN, "Unknown log level '%s', keeping default", v);
+}
+
 static void parse_ints(char *str, int *out, int max) {
   int count = 0;
   char *token = strtok(str, " \t\n");
@@ -25,15 +136,23 @@ static void parse_ints(char *str, int *out, int max) {
   }
 }
 
-void Config::load() {
-  state = ConfigState();
-
+bool Config::load() {
+  WAUL_TRACE_SCOPE("config_load");
   FILE *f = fopen(get_path().c_str(), "r");
   if (!f) {
     log_msg(WARN, "Config file not found at %s", get_path().c_str());
-    return;
+    // Mid-save editors briefly leave no file; keep what was loaded
+    if (loaded)
+      return false;
+    loaded = true;
+    return true;
   }
 
+  uint64_t before = hash(state);
+  bool first = !loaded;
+  loaded = true;
+  state = ConfigState();
+
   char line[256];
   while (fgets(line, sizeof(line), f)) {
     char *start = line;
@@ -64,9 +183,72 @@ void Config::load() {
       parse_ints(val, state.bc, 4);
     else if (strcmp(key, "background_color") == 0)
       parse_ints(val, state.bg, 4);
+    else if (strcmp(key, "filter") == 0)
+      parse_filter(val, state.filter);
+    else if (strcmp(key, "fit") == 0)
+      parse_fit(val, state.fit);
+    else if (strcmp(key, "threads") == 0)
+      parse_ints(val, &state.threads, 1);
+    else if (strcmp(key, "frame_cache") == 0)
+      parse_ints(val, &state.frame_cache_mb, 1);
+    else if (strcmp(key, "preload_limit") == 0)
+      parse_ints(val, &state.preload_mb, 1);
+    else if (strcmp(key, "slideshow") == 0)
+      parse_path(val, state.slideshow);
+    else if (strcmp(key, "slideshow_interval") == 0)
+      parse_ints(val, &state.slideshow_interval, 1);
+    else if (strcmp(key, "slideshow_order") == 0)
+      parse_order(val, state.slideshow_shuffle);
+    else if (strcmp(key, "current_wall") == 0)
+      parse_export(val, state.wall_export);
+    else if (strcmp(key, "log_level") == 0)
+      parse_log_level(val, state.log_level);
+    else if (strcmp(key, "log_flush") == 0)
+      parse_ints(val, &state.log_flush, 1);
+    else if (strcmp(key, "log_limit") == 0)
+      parse_ints(val, &state.log_limit, 1);
   }
   fclose(f);
-  log_msg(INFO, "Config loaded");
+  log_configure(state.log_level, state.log_flush, state.log_limit);
+
+  bool changed = first || hash(state) != before;
+  if (changed)
+    log_msg(INFO, "Config loaded");
+  else
+    log_msg(DEBUG, "Config reloaded, nothing visible changed");
+  return changed;
+}
+
+int Config::watch() {
+  int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  // The directory, not the file: editors and home-manager replace
+  // config.ini by rename, which would orphan a watch on the file itself
+  uint32_t mask = IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE |
+                  IN_MOVED_FROM;
+  if (inotify_add_watch(fd, get_config_dir().c_str(), mask) < 0) {
+    log_msg(WARN, "Cannot watch %s, config changes apply on next set",
+            get_config_dir().c_str());
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+bool Config::watch_pending(int fd) {
+  alignas(inotify_event) char buf[4096];
+  bool touched = false;
+  ssize_t n;
+  while ((n = read(fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      const inotify_event *ev = (const inotify_event *)p;
+      if (ev->len && strcmp(ev->name, "config.ini") == 0)
+        touched = true;
+      p += sizeof(inotify_event) + ev->len;
+    }
+  }
+  return touched;
 }
 
 } // namespace waul
\ No newline at end of file
@@ -1,24 +1,55 @@
 #pragma once
+#include "common.hpp"
+#include <cstdint>
 #include <string>
 
 namespace waul {
 
+enum Filter { FILTER_NEAREST, FILTER_BILINEAR, FILTER_AREA };
+enum Fit { FIT_COVER, FIT_CONTAIN, FIT_CENTER, FIT_TILE, FIT_STRETCH };
+enum ExportMode { EXPORT_COPY, EXPORT_HARDLINK, EXPORT_SYMLINK, EXPORT_NONE };
+
 struct ConfigState {
   int m[4] = {0, 0, 0, 0};    // Margins
   int bw[4] = {0, 0, 0, 0};   // Border Width
   int br[4] = {0, 0, 0, 0};   // Border Radius
   int bc[4] = {0, 0, 0, 255}; // Border Color
   int bg[4] = {0, 0, 0, 255}; // Background Color
+  Filter filter = FILTER_AREA; // Image scaling filter
+  Fit fit = FIT_COVER;         // How the image fills the content area
+  int threads = 0;              // Render threads, 0 = one per core
+  int frame_cache_mb = 256;     // Rendered frame cache budget, 0 = off
+  int preload_mb = 128;         // Preloaded frames, all outputs, 0 = off
+  std::string slideshow;        // Image directory or list file, "" = off
+  int slideshow_interval = 600; // Seconds per image
+  bool slideshow_shuffle = false;
+  ExportMode wall_export = EXPORT_COPY; // How current_wall mirrors the image
+  LogLevel log_level = INFO;            // Lowest level written to waul.log
+  int log_flush = 500;                  // Milliseconds between log writes
+  int log_limit = 4; // MB before waul.log rotates to waul.log.1, 0 = never
 };
 
 class Config {
 public:
   static ConfigState &get();
-  static void load();
+  // Parses config.ini. Returns true on the first load and whenever the
+  // result looks different from before.
+  static bool load();
   static std::string get_path();
 
+  // inotify fd watching the config directory, -1 if unavailable
+  static int watch();
+  // Drains the watch; true if config.ini was written, replaced or removed
+  static bool watch_pending(int fd);
+  // Hash of the fields that change what a frame looks like
+  static uint64_t hash(const ConfigState &s);
+  // Same, leaving out colors: equal layouts differ only in how they are
+  // painted, never in where things are
+  static uint64_t layout_hash(const ConfigState &s);
+
 private:
   static ConfigState state;
+  static bool loaded;
 };
 
 } // namespace waul
\ No newline at end of file
@@ -0,0 +1,351 @@
+#include "decoder.hpp"
+#include "common.hpp"
+#include "pixel_ops.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <csetjmp>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#ifdef WAUL_HAVE_JPEG
+#include <jpeglib.h>
+#ifndef JCS_EXTENSIONS
+#error "WAUL_HAVE_JPEG needs libjpeg-turbo for JCS_EXT_BGRX"
+#endif
+#endif
+#ifdef WAUL_HAVE_PNG
+#include <png.h>
+#endif
+
+#define STB_IMAGE_IMPLEMENTATION
+#include <stb/stb_image.h>
+
+namespace waul {
+
+// Largest power of two up to max that w x h can be divided by while still
+// covering want_w x want_h.
+static int reduce_factor(int w, int h, int want_w, int want_h, int max) {
+  if (want_w <= 0 || want_h <= 0)
+    return 1;
+  int k = 1;
+  while (k < max && (w + 2 * k - 1) / (2 * k) >= want_w &&
+         (h + 2 * k - 1) / (2 * k) >= want_h)
+    k *= 2;
+  return k;
+}
+
+// k x k box reduction fed one source row at a time, so only a row of sums
+// is held next to the output. Edge boxes average whatever they cover.
+class RowReducer {
+public:
+  bool init(int w_, int h_, int k_, Image &out_) {
+    w = w_;
+    k = k_;
+    out = &out_;
+    out->w = (w + k - 1) / k;
+    out->h = (h_ + k - 1) / k;
+    out->pixels = (uint32_t *)malloc((size_t)out->w * out->h * 4);
+    r.assign(out->w, 0);
+    g.assign(out->w, 0);
+    b.assign(out->w, 0);
+    return out->pixels != nullptr;
+  }
+
+  void push(const uint32_t *row) {
+    for (int x = 0; x < w; x++) {
+      uint32_t p = row[x];
+      int i = x / k;
+      r[i] += (p >> 16) & 0xFF;
+      g[i] += (p >> 8) & 0xFF;
+      b[i] += p & 0xFF;
+    }
+    if (++rows == k)
+      flush();
+  }
+
+  // Emits a partial last row group, if any
+  void flush() {
+    if (!rows)
+      return;
+    uint32_t *dst = out->pixels + (size_t)y++ * out->w;
+    for (int i = 0; i < out->w; i++) {
+      uint32_t d = std::min(k, w - i * k) * rows;
+      dst[i] = 0xFF000000 | ((r[i] + d / 2) / d) << 16 |
+               ((g[i] + d / 2) / d) << 8 | (b[i] + d / 2) / d;
+      r[i] = g[i] = b[i] = 0;
+    }
+    rows = 0;
+  }
+
+private:
+  Image *out = nullptr;
+  int w = 0, k = 1, rows = 0, y = 0;
+  std::vector<uint32_t> r, g, b;
+};
+
+static bool reduce(Image &img, int k) {
+  Image small;
+  RowReducer red;
+  if (!red.init(img.w, img.h, k, small)) {
+    free(small.pixels);
+    return false;
+  }
+  for (int y = 0; y < img.h; y++)
+    red.push(img.pixels + (size_t)y * img.w);
+  red.flush();
+  free(img.pixels);
+  img = small;
+  return true;
+}
+
+#ifdef WAUL_HAVE_JPEG
+
+struct JpegError {
+  jpeg_error_mgr mgr;
+  jmp_buf jump;
+};
+
+static void jpeg_fail(j_common_ptr cinfo) {
+  char msg[JMSG_LENGTH_MAX];
+  cinfo->err->format_message(cinfo, msg);
+  log_msg(WARN, "JPEG decode failed: %s", msg);
+  longjmp(((JpegError *)cinfo->err)->jump, 1);
+}
+
+static void jpeg_quiet(j_common_ptr, int) {}
+
+static bool jpeg_probe(const uint8_t *data, size_t len) {
+  return len > 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+static bool jpeg_decode(const uint8_t *data, size_t len, int want_w,
+                        int want_h, Image &out) {
+  WAUL_TRACE_SCOPE("jpeg_decode");
+  jpeg_decompress_struct cinfo;
+  JpegError err;
+  cinfo.err = jpeg_std_error(&err.mgr);
+  err.mgr.error_exit = jpeg_fail;
+  err.mgr.emit_message = jpeg_quiet;
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&cinfo);
+    free(out.pixels);
+    out = Image();
+    return false;
+  }
+
+  jpeg_create_decompress(&cinfo);
+  jpeg_mem_src(&cinfo, (unsigned char *)data, len);
+  jpeg_read_header(&cinfo, TRUE);
+
+  // The IDCT emits 1/2, 1/4 or 1/8 size blocks directly, so a photo far
+  // larger than the output never exists at full resolution
+  cinfo.scale_num = 1;
+  cinfo.scale_denom = reduce_factor(cinfo.image_width, cinfo.image_height,
+                                    want_w, want_h, 8);
+  // B, G, R, 0xFF in memory is XRGB8888 on little endian
+  cinfo.out_color_space = JCS_EXT_BGRX;
+  jpeg_start_decompress(&cinfo);
+
+  out.w = cinfo.output_width;
+  out.h = cinfo.output_height;
+  out.pixels = (uint32_t *)malloc((size_t)out.w * out.h * 4);
+  if (!out.pixels) {
+    jpeg_destroy_decompress(&cinfo);
+    out = Image();
+    return false;
+  }
+  while (cinfo.output_scanline < cinfo.output_height) {
+    JSAMPROW row =
+        (JSAMPROW)(out.pixels + (size_t)cinfo.output_scanline * out.w);
+    jpeg_read_scanlines(&cinfo, &row, 1);
+  }
+  jpeg_finish_decompress(&cinfo);
+  jpeg_destroy_decompress(&cinfo);
+  return true;
+}
+
+#endif
+
+#ifdef WAUL_HAVE_PNG
+
+struct PngJob {
+  png_structp png = nullptr;
+  png_infop info = nullptr;
+  const uint8_t *data = nullptr;
+  size_t len = 0, pos = 0;
+  std::vector<uint32_t> row;
+  RowReducer reducer;
+};
+
+static void png_read_mem(png_structp png, png_bytep dst, png_size_t n) {
+  PngJob *job = (PngJob *)png_get_io_ptr(png);
+  if (n > job->len - job->pos)
+    png_error(png, "truncated file");
+  memcpy(dst, job->data + job->pos, n);
+  job->pos += n;
+}
+
+static void png_fail(png_structp png, png_const_charp msg) {
+  log_msg(WARN, "PNG decode failed: %s", msg);
+  png_longjmp(png, 1);
+}
+
+static void png_quiet(png_structp, png_const_charp) {}
+
+// Interlaced images need every pass before a row is final, so they are left
+// to stb
+static bool png_probe(const uint8_t *data, size_t len) {
+  return len > 28 && png_sig_cmp(data, 0, 8) == 0 && data[28] == 0;
+}
+
+static void png_decode_rows(PngJob &job, int want_w, int want_h,
+                            Image &out) {
+  png_set_read_fn(job.png, &job, png_read_mem);
+  png_read_info(job.png, job.info);
+  int w = png_get_image_width(job.png, job.info);
+  int h = png_get_image_height(job.png, job.info);
+
+  // Normalise every colour type and depth to B, G, R, 0xFF bytes
+  png_set_expand(job.png);
+  png_set_strip_16(job.png);
+  png_set_strip_alpha(job.png);
+  png_set_gray_to_rgb(job.png);
+  png_set_bgr(job.png);
+  png_set_filler(job.png, 0xFF, PNG_FILLER_AFTER);
+  png_read_update_info(job.png, job.info);
+
+  int k = reduce_factor(w, h, want_w, want_h, 64);
+  if (k == 1) {
+    out.w = w;
+    out.h = h;
+    out.pixels = (uint32_t *)malloc((size_t)w * h * 4);
+    if (!out.pixels)
+      png_error(job.png, "out of memory");
+    for (int y = 0; y < h; y++)
+      png_read_row(job.png, (png_bytep)(out.pixels + (size_t)y * w), nullptr);
+    return;
+  }
+
+  // Rows are reduced as they arrive, the full image is never held
+  if (!job.reducer.init(w, h, k, out))
+    png_error(job.png, "out of memory");
+  job.row.resize(w);
+  for (int y = 0; y < h; y++) {
+    png_read_row(job.png, (png_bytep)job.row.data(), nullptr);
+    job.reducer.push(job.row.data());
+  }
+  job.reducer.flush();
+}
+
+static bool png_decode(const uint8_t *data, size_t len, int want_w,
+                       int want_h, Image &out) {
+  WAUL_TRACE_SCOPE("png_decode");
+  PngJob job;
+  job.data = data;
+  job.len = len;
+  job.png = png_create_read_struct(PNG_LIBPNG_VER_STRING, nullptr, png_fail,
+                                   png_quiet);
+  if (job.png)
+    job.info = png_create_info_struct(job.png);
+  if (!job.info) {
+    png_destroy_read_struct(&job.png, nullptr, nullptr);
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(job.png))) {
+    png_destroy_read_struct(&job.png, &job.info, nullptr);
+    free(out.pixels);
+    out = Image();
+    return false;
+  }
+  png_decode_rows(job, want_w, want_h, out);
+  png_destroy_read_struct(&job.png, &job.info, nullptr);
+  return true;
+}
+
+#endif
+
+static bool stb_probe(const uint8_t *, size_t) { return true; }
+
+static bool stb_decode(const uint8_t *data, size_t len, int, int,
+                       Image &out) {
+  WAUL_TRACE_SCOPE("stbi_load");
+  int ic = 0;
+  uint8_t *px =
+      stbi_load_from_memory(data, (int)len, &out.w, &out.h, &ic, 4);
+  if (!px) {
+    out = Image();
+    return false;
+  }
+  // Converted in place once so sampling is a plain word copy
+  out.pixels = (uint32_t *)px;
+  pixel_ops().swizzle(out.pixels, px, (size_t)out.w * out.h);
+  return true;
+}
+
+static const Decoder decoders[] = {
+#ifdef WAUL_HAVE_JPEG
+    {"jpeg", jpeg_probe, jpeg_decode},
+#endif
+#ifdef WAUL_HAVE_PNG
+    {"png", png_probe, png_decode},
+#endif
+    {"stb", stb_probe, stb_decode},
+};
+
+bool image_load(const std::string &path, Image &out, int want_w,
+                int want_h) {
+  WAUL_TRACE_SCOPE("image_load");
+  out = Image();
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  void *map = MAP_FAILED;
+  if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size > 0)
+    map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (fd >= 0)
+    close(fd);
+  if (map == MAP_FAILED) {
+    log_msg(WARN, "Failed to open image: %s", path.c_str());
+    return false;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+  const uint8_t *data = (const uint8_t *)map;
+  const Decoder *used = nullptr;
+  for (const Decoder &d : decoders) {
+    if (d.probe(data, st.st_size) &&
+        d.decode(data, st.st_size, want_w, want_h, out)) {
+      used = &d;
+      break;
+    }
+  }
+  munmap(map, st.st_size);
+
+  if (!used) {
+    log_msg(WARN, "Failed to decode image: %s", path.c_str());
+    return false;
+  }
+
+  // Whatever the decoder could not shed itself is boxed down here, so only
+  // about the output resolution stays resident while compositing
+  int k = reduce_factor(out.w, out.h, want_w, want_h, 64);
+  if (k > 1 && !reduce(out, k))
+    log_msg(WARN, "Could not reduce %dx%d image", out.w, out.h);
+  log_msg(DEBUG, "Decoded %s with %s at %dx%d", path.c_str(), used->name,
+          out.w, out.h);
+  return true;
+}
+
+void image_free(Image &img) {
+  free(img.pixels);
+  img = Image();
+}
+
+} // namespace waul
@@ -0,0 +1,25 @@
+#pragma once
+#include "compositor.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace waul {
+
+// One image format. decode() reads straight from a mapping of the whole file
+// and may hand back a reduced image, as long as it still covers want_w x
+// want_h (0 x 0 asks for full resolution). Pixels are malloc'd XRGB8888.
+struct Decoder {
+  const char *name;
+  bool (*probe)(const uint8_t *data, size_t len);
+  bool (*decode)(const uint8_t *data, size_t len, int want_w, int want_h,
+                 Image &out);
+};
+
+// Decodes path with the first decoder that recognises it, falling back to
+// stb_image for everything else.
+bool image_load(const std::string &path, Image &out, int want_w = 0,
+                int want_h = 0);
+void image_free(Image &img);
+
+} // namespace waul
@@ -0,0 +1,184 @@
+#include "event_loop.hpp"
+#include "common.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+#include <vector>
+
+namespace waul {
+
+struct Watch {
+  EventLoop::Handler fn = nullptr;
+  void *data = nullptr;
+};
+
+struct Timer {
+  uint64_t id, at;
+  EventLoop::Handler fn;
+  void *data;
+};
+
+static int epfd = -1, tfd = -1, sfd = -1;
+static std::vector<Watch> watches; // indexed by fd
+// Few at a time (IPC deadlines), so a plain list scanned for the earliest
+static std::vector<Timer> timers;
+static uint64_t next_timer_id = 1;
+static bool terminated = false;
+
+uint64_t EventLoop::now_ms() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// The timerfd fires for the earliest timer only and is disarmed without
+// one, so timers that are not there cost no wakeups
+static void arm() {
+  itimerspec its{};
+  if (!timers.empty()) {
+    uint64_t at = timers[0].at;
+    for (const Timer &t : timers)
+      at = std::min(at, t.at);
+    // A zero it_value would disarm it
+    at = std::max<uint64_t>(at, 1);
+    its.it_value.tv_sec = at / 1000;
+    its.it_value.tv_nsec = (at % 1000) * 1000000;
+  }
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, nullptr);
+}
+
+static void timers_due(void *, uint32_t) {
+  uint64_t expirations;
+  if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno == EAGAIN)
+    return;
+  uint64_t now = EventLoop::now_ms();
+  std::vector<uint64_t> due;
+  for (const Timer &t : timers) {
+    if (t.at <= now)
+      due.push_back(t.id);
+  }
+  // Handlers may add or cancel timers, including ones due in this batch,
+  // so each is looked up again right before it runs
+  for (uint64_t id : due) {
+    auto it = std::find_if(timers.begin(), timers.end(),
+                           [id](const Timer &t) { return t.id == id; });
+    if (it == timers.end())
+      continue;
+    Timer t = *it;
+    timers.erase(it);
+    t.fn(t.data, 0);
+  }
+  arm();
+}
+
+static void signalled(void *, uint32_t) {
+  signalfd_siginfo si;
+  while (read(sfd, &si, sizeof(si)) == sizeof(si)) {
+    log_msg(INFO, "Caught signal %u, shutting down", si.ssi_signo);
+    terminated = true;
+  }
+}
+
+static sigset_t handled_signals() {
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGINT);
+  sigaddset(&set, SIGTERM);
+  return set;
+}
+
+bool EventLoop::init() {
+  sigset_t set = handled_signals();
+  pthread_sigmask(SIG_BLOCK, &set, nullptr);
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  sfd = signalfd(-1, &set, SFD_NONBLOCK | SFD_CLOEXEC);
+  if (epfd < 0 || tfd < 0 || sfd < 0 ||
+      !add(tfd, EPOLLIN, timers_due, nullptr) ||
+      !add(sfd, EPOLLIN, signalled, nullptr)) {
+    shutdown();
+    return false;
+  }
+  return true;
+}
+
+void EventLoop::shutdown() {
+  for (int *fd : {&tfd, &sfd, &epfd}) {
+    if (*fd >= 0)
+      close(*fd);
+    *fd = -1;
+  }
+  watches.clear();
+  timers.clear();
+}
+
+bool EventLoop::add(int fd, uint32_t events, Handler fn, void *data) {
+  if (fd < 0 || epfd < 0)
+    return false;
+  epoll_event ev{};
+  ev.events = events;
+  ev.data.fd = fd;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) != 0)
+    return false;
+  if ((size_t)fd >= watches.size())
+    watches.resize(fd + 1);
+  watches[fd] = {fn, data};
+  return true;
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+  epoll_event ev{};
+  ev.events = events;
+  ev.data.fd = fd;
+  epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void EventLoop::remove(int fd) {
+  if (fd < 0 || (size_t)fd >= watches.size() || !watches[fd].fn)
+    return;
+  epoll_ctl(epfd, EPOLL_CTL_DEL, fd, nullptr);
+  watches[fd] = Watch();
+}
+
+uint64_t EventLoop::add_timer(uint64_t at_ms, Handler fn, void *data) {
+  uint64_t id = next_timer_id++;
+  timers.push_back({id, at_ms, fn, data});
+  arm();
+  return id;
+}
+
+void EventLoop::cancel_timer(uint64_t id) {
+  for (size_t i = 0; i < timers.size(); i++) {
+    if (timers[i].id == id) {
+      timers.erase(timers.begin() + i);
+      arm();
+      return;
+    }
+  }
+}
+
+bool EventLoop::wait(int timeout_ms) {
+  epoll_event evs[32];
+  int n = epoll_wait(epfd, evs, 32, timeout_ms);
+  if (n < 0)
+    return errno == EINTR;
+  WAUL_TRACE_SCOPE("wakeup");
+  for (int i = 0; i < n; i++) {
+    // Looked up per event: an earlier handler may have removed this fd
+    int fd = evs[i].data.fd;
+    if ((size_t)fd < watches.size() && watches[fd].fn)
+      watches[fd].fn(watches[fd].data, evs[i].events);
+  }
+  return !terminated;
+}
+
+} // namespace waul
@@ -0,0 +1,37 @@
+#pragma once
+#include <cstdint>
+
+namespace waul {
+
+// The daemon's reactor: one epoll fd, a timerfd for timers and a signalfd
+// for SIGINT and SIGTERM. Everything runs on the thread calling wait();
+// with no timer pending and nothing readable it sleeps in epoll_wait
+// without a timeout.
+class EventLoop {
+public:
+  // Called with the epoll events that fired. After remove() a handler is
+  // not called again, but a new watch on a reused fd number can see one
+  // stale wakeup, so handlers must cope with EAGAIN.
+  typedef void (*Handler)(void *data, uint32_t events);
+
+  // Blocks the handled signals, so call it before any thread is started:
+  // threads inherit the mask and the signals then only reach the signalfd.
+  static bool init();
+  static void shutdown();
+
+  static bool add(int fd, uint32_t events, Handler fn, void *data);
+  static void modify(int fd, uint32_t events);
+  static void remove(int fd);
+
+  // Calls fn once, at_ms milliseconds on the CLOCK_MONOTONIC clock from
+  // now_ms(). Returns an id for cancel_timer(), never 0.
+  static uint64_t add_timer(uint64_t at_ms, Handler fn, void *data);
+  static void cancel_timer(uint64_t id);
+  static uint64_t now_ms();
+
+  // Waits for events, at most timeout_ms unless -1, and runs their
+  // handlers. False once a termination signal arrived or epoll failed.
+  static bool wait(int timeout_ms);
+};
+
+} // namespace waul
@@ -0,0 +1,185 @@
+#include "frame_cache.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace waul {
+
+// Pixels start on a page boundary so the data can be mmap'd or block cloned
+static constexpr size_t HEADER_SIZE = 4096;
+static constexpr char MAGIC[8] = {'W', 'A', 'U', 'L', 'F', 'R', 'M', '1'};
+
+struct Header {
+  char magic[8];
+  uint32_t w, h;
+  uint64_t key;
+};
+
+static std::string cache_dir() {
+  static std::string dir;
+  if (dir.empty()) {
+    dir = get_cache_dir() + "/frames";
+    ensure_dir(dir);
+  }
+  return dir;
+}
+
+static std::string entry_path(uint64_t key) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.frame", (unsigned long long)key);
+  return cache_dir() + name;
+}
+
+uint64_t FrameCache::key(const std::string &path, int w, int h,
+                         const ConfigState &cfg) {
+  struct stat st;
+  if (cfg.frame_cache_mb <= 0 || path.empty() ||
+      stat(path.c_str(), &st) != 0)
+    return 0;
+
+  uint64_t k = HASH_SEED;
+  hash_mix(k, path.data(), path.size());
+  hash_mix(k, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+  hash_mix(k, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+  hash_mix(k, &st.st_size, sizeof(st.st_size));
+  hash_mix(k, &w, sizeof(w));
+  hash_mix(k, &h, sizeof(h));
+  uint64_t c = Config::hash(cfg);
+  hash_mix(k, &c, sizeof(c));
+  return k ? k : 1;
+}
+
+// Lets the kernel move the pixels into the memfd when it can and falls back
+// to reading them through the mapping
+static bool copy_pixels(int src, int dst, off_t offset, uint32_t *pixels,
+                        size_t size) {
+  loff_t in = HEADER_SIZE, out = offset;
+  size_t done = 0;
+  while (done < size) {
+    ssize_t n = copy_file_range(src, &in, dst, &out, size - done, 0);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  while (done < size) {
+    ssize_t n =
+        pread(src, (char *)pixels + done, size - done, HEADER_SIZE + done);
+    if (n <= 0)
+      return false;
+    done += n;
+  }
+  return true;
+}
+
+bool FrameCache::fetch(uint64_t key, const Frame &frame, int fd,
+                       off_t offset) {
+  if (!key || frame.stride != frame.w)
+    return false;
+
+  size_t size = (size_t)frame.w * frame.h * 4;
+  int src = open(entry_path(key).c_str(), O_RDONLY | O_CLOEXEC);
+  if (src < 0)
+    return false;
+
+  Header hdr;
+  struct stat st;
+  bool ok = pread(src, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+            memcmp(hdr.magic, MAGIC, sizeof(MAGIC)) == 0 &&
+            hdr.key == key && (int)hdr.w == frame.w &&
+            (int)hdr.h == frame.h && fstat(src, &st) == 0 &&
+            (size_t)st.st_size == HEADER_SIZE + size &&
+            copy_pixels(src, fd, offset, frame.pixels, size);
+  // mtime doubles as the last use time for eviction
+  if (ok)
+    futimens(src, nullptr);
+  close(src);
+
+  if (!ok) {
+    log_msg(WARN, "Dropping bad frame cache entry %016llx",
+            (unsigned long long)key);
+    unlink(entry_path(key).c_str());
+  }
+  return ok;
+}
+
+struct Entry {
+  std::string name;
+  time_t mtime;
+  off_t size;
+};
+
+static void evict(size_t budget) {
+  std::string dir = cache_dir();
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+
+  std::vector<Entry> entries;
+  size_t total = 0;
+  while (dirent *e = readdir(d)) {
+    struct stat st;
+    size_t len = strlen(e->d_name);
+    if (len < 6 || strcmp(e->d_name + len - 6, ".frame") != 0 ||
+        fstatat(dirfd(d), e->d_name, &st, 0) != 0)
+      continue;
+    entries.push_back(Entry{e->d_name, st.st_mtime, st.st_size});
+    total += st.st_size;
+  }
+
+  std::sort(entries.begin(), entries.end(),
+            [](const Entry &a, const Entry &b) { return a.mtime < b.mtime; });
+  for (size_t i = 0; i < entries.size() && total > budget; i++) {
+    if (unlinkat(dirfd(d), entries[i].name.c_str(), 0) == 0) {
+      total -= entries[i].size;
+      log_msg(DEBUG, "Evicted frame %s", entries[i].name.c_str());
+    }
+  }
+  closedir(d);
+}
+
+void FrameCache::store(uint64_t key, const Frame &frame, int budget_mb) {
+  size_t size = (size_t)frame.w * frame.h * 4;
+  size_t budget = (size_t)budget_mb << 20;
+  if (!key || frame.stride != frame.w || HEADER_SIZE + size > budget)
+    return;
+
+  // Written under a temporary name so readers never see a partial entry
+  std::string path = entry_path(key);
+  std::string tmp = path + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+
+  char hdr[HEADER_SIZE] = {};
+  Header h;
+  memcpy(h.magic, MAGIC, sizeof(MAGIC));
+  h.w = frame.w;
+  h.h = frame.h;
+  h.key = key;
+  memcpy(hdr, &h, sizeof(h));
+
+  bool ok = write(fd, hdr, HEADER_SIZE) == (ssize_t)HEADER_SIZE;
+  const char *p = (const char *)frame.pixels;
+  for (size_t done = 0; ok && done < size;) {
+    ssize_t n = write(fd, p + done, size - done);
+    ok = n > 0;
+    done += ok ? n : 0;
+  }
+  ok = close(fd) == 0 && ok;
+
+  if (!ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    log_msg(WARN, "Could not write frame cache entry %s", path.c_str());
+    unlink(tmp.c_str());
+    return;
+  }
+  evict(budget);
+}
+
+} // namespace waul
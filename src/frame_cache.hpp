@@ -0,0 +1,29 @@
+#pragma once
+#include "compositor.hpp"
+#include "config.hpp"
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+namespace waul {
+
+// On-disk cache of finished frames under get_cache_dir()/frames. Entries are
+// raw XRGB8888 after a page sized header, so a hit can be copied straight
+// into a shm buffer without decoding or compositing anything.
+class FrameCache {
+public:
+  // Key for path rendered at w x h with cfg, or 0 if the frame should not
+  // be cached (no image, unreadable source, cache disabled).
+  static uint64_t key(const std::string &path, int w, int h,
+                      const ConfigState &cfg);
+
+  // Fills frame, which is mapped from offset of fd, with the entry for key.
+  // Returns false on a miss.
+  static bool fetch(uint64_t key, const Frame &frame, int fd, off_t offset);
+
+  // Writes frame as the entry for key, then evicts the least recently used
+  // entries until the cache fits in budget_mb.
+  static void store(uint64_t key, const Frame &frame, int budget_mb);
+};
+
+} // namespace waul
@@ -1,60 +1,200 @@
 #include "ipc.hpp"
 #include "common.hpp"
+#include "event_loop.hpp"
+#include "palette.hpp"
+#include "slideshow.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 #include "wayland_backend.hpp"
 
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
 #include <cstring>
-#include <iostream>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 
 namespace waul {
 
-static void send_str(int fd, const char *s) {
-  if (write(fd, s, strlen(s)) < 0) {
+static constexpr size_t MAX_CLIENTS = 32;
+// A subscriber this far behind is not reading; it is dropped
+static constexpr size_t MAX_BACKLOG = 1024 * 1024;
+
+struct Client {
+  int fd = -1; // -1 once closed, freed on the next ipc_poll_fds()
+  uint32_t serial = 0;
+  bool framed = false;
+  bool legacy = false;
+  bool subscribed = false;
+  bool closing = false; // close as soon as out is flushed
+  uint32_t events = 0;  // what the EventLoop watches for
+  uint64_t deadline = 0; // timer while a request is due, 0 if none
+  std::string in, out;
+};
+
+static int server_fd = -1;
+static std::vector<Client *> clients;
+static uint32_t next_serial = 1;
+static std::string last_event; // replayed to new subscribers
+
+// Client side runs for every bar refresh, so it sticks to plain syscalls:
+// no directories are created and nothing goes through stdio
+static int connect_daemon() {
+  std::string path = get_socket_path(false);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return -1;
+
+  struct sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+
+  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    int err = errno;
+    close(sock);
+    // Nobody listening: left behind by a daemon that died
+    if (err == ECONNREFUSED)
+      unlink(path.c_str());
+    return -1;
   }
+  return sock;
+}
+
+static void append_frame(std::string &out, uint32_t id, uint32_t status,
+                         const std::string &payload) {
+  IpcHeader h;
+  memcpy(h.magic, IPC_MAGIC, 4);
+  h.len = payload.size();
+  h.id = id;
+  h.status = status;
+  out.append((const char *)&h, sizeof(h));
+  out += payload;
+}
+
+static bool write_full(int fd, const char *d, size_t len) {
+  while (len > 0) {
+    ssize_t n = send(fd, d, len, MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    d += n;
+    len -= n;
+  }
+  return true;
+}
+
+// write_full() for stdout and stderr, which are not sockets
+static bool write_out(int fd, const char *d, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, d, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    d += n;
+    len -= n;
+  }
+  return true;
+}
+
+static bool read_full(int fd, void *d, size_t len) {
+  char *p = (char *)d;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return false;
+    p += n;
+    len -= n;
+  }
+  return true;
+}
+
+// One message from the daemon; false once the connection is gone
+static bool read_message(int fd, IpcHeader &h, std::string &payload) {
+  if (!read_full(fd, &h, sizeof(h)) || memcmp(h.magic, IPC_MAGIC, 4) != 0 ||
+      h.len > IPC_MAX_PAYLOAD)
+    return false;
+  payload.resize(h.len);
+  return read_full(fd, &payload[0], h.len);
 }
 
-static void send_data(int fd, const char *d, size_t len) {
-  if (write(fd, d, len) < 0) {
+// NUL separated fields as one line, separated by spaces, in one write
+static void print_fields(int fd, const char *prefix,
+                         const std::string &payload) {
+  size_t len = payload.size();
+  while (len > 0 && payload[len - 1] == 0)
+    len--;
+  std::string line = prefix;
+  line.append(payload, 0, len);
+  for (char &c : line) {
+    if (c == 0)
+      c = ' ';
   }
+  line += '\n';
+  write_out(fd, line.data(), line.size());
 }
 
-int ipc_send_command(const std::string &cmd, bool wait_response) {
-  int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+int ipc_send_command(const std::string &cmd, const std::string &arg,
+                     bool wait_response) {
+  int sock = connect_daemon();
   if (sock < 0)
     return 1;
 
-  struct sockaddr_un addr{};
-  addr.sun_family = AF_UNIX;
-  strncpy(addr.sun_path, get_socket_path().c_str(), sizeof(addr.sun_path) - 1);
-
-  if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+  std::string payload = cmd + '\0';
+  if (!arg.empty())
+    payload += arg + '\0';
+  std::string msg;
+  append_frame(msg, 1, 0, payload);
+  if (!write_full(sock, msg.data(), msg.size())) {
     close(sock);
-    if (access(get_socket_path().c_str(), F_OK) == 0) {
-      unlink(get_socket_path().c_str());
-    }
     return 1;
   }
 
-  send_data(sock, cmd.c_str(), cmd.size());
-
-  if (wait_response) {
-    char buf[1024] = {0};
-    ssize_t n = read(sock, buf, sizeof(buf) - 1);
-    if (n > 0)
-      std::cout << buf << std::endl;
+  int rc = 0;
+  IpcHeader h;
+  if (wait_response && read_message(sock, h, payload)) {
+    if (h.status >= IPC_ERR_BAD_REQUEST) {
+      print_fields(STDERR_FILENO, "err: ", payload);
+      rc = 2;
+    } else {
+      print_fields(STDOUT_FILENO, "", payload);
+    }
   }
+  close(sock);
+  return rc;
+}
 
+int ipc_subscribe() {
+  int sock = connect_daemon();
+  if (sock < 0)
+    return 1;
+  std::string msg, payload;
+  append_frame(msg, 1, 0, std::string("subscribe") + '\0');
+  if (!write_full(sock, msg.data(), msg.size())) {
+    close(sock);
+    return 1;
+  }
+  IpcHeader h;
+  while (read_message(sock, h, payload)) {
+    if (h.status == IPC_EVENT)
+      print_fields(STDOUT_FILENO, "", payload);
+  }
   close(sock);
   return 0;
 }
 
+static void on_accept(void *, uint32_t);
+
 int ipc_server_init() {
   std::string path = get_socket_path();
   unlink(path.c_str());
 
-  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
   if (sock < 0) {
     log_msg(ERROR, "Failed to create IPC socket");
     return -1;
@@ -75,40 +215,348 @@ int ipc_server_init() {
     return -1;
   }
 
+  if (!EventLoop::add(sock, EPOLLIN, on_accept, nullptr)) {
+    close(sock);
+    return -1;
+  }
+
   log_msg(SUCCESS, "IPC Server listening on %s", path.c_str());
+  server_fd = sock;
   return sock;
 }
 
-int ipc_server_accept(int server_fd) {
-  return accept(server_fd, nullptr, nullptr);
-}
-
-void ipc_handle_client(int fd) {
-  char buf[1024] = {0};
-  if (read(fd, buf, sizeof(buf) - 1) > 0) {
-    std::string cmd(buf);
-    log_msg(DEBUG, "IPC Recv: %s", buf);
-
-    if (cmd == "ping") {
-      send_str(fd, "pong");
-    } else if (cmd == "quit") {
-      Wayland::stop();
-      send_str(fd, "bye");
-    } else if (cmd == "query") {
-      std::string p = Wayland::get_current_wallpaper();
-      send_data(fd, p.c_str(), p.size());
-    } else if (cmd.find("set|") == 0) {
-      std::string p = cmd.substr(4);
-      if (access(p.c_str(), F_OK) == 0) {
-        Wayland::set_wallpaper(p);
-        send_str(fd, "ok");
-      } else {
-        send_str(fd, "err: not found");
-        log_msg(WARN, "IPC Request file not found: %s", p.c_str());
-      }
+static void drop_client(Client &c) {
+  if (c.deadline)
+    EventLoop::cancel_timer(c.deadline);
+  c.deadline = 0;
+  if (c.fd >= 0) {
+    EventLoop::remove(c.fd);
+    close(c.fd);
+  }
+  c.fd = -1;
+}
+
+// A legacy client has sent its one request; output is watched only while
+// some is queued
+static void watch(Client &c) {
+  uint32_t events = c.legacy ? 0u : (uint32_t)EPOLLIN;
+  if (!c.out.empty())
+    events |= EPOLLOUT;
+  if (c.fd >= 0 && events != c.events) {
+    EventLoop::modify(c.fd, events);
+    c.events = events;
+  }
+}
+
+// Writes what the socket takes now; the rest waits for POLLOUT
+static void flush(Client &c) {
+  while (c.fd >= 0 && !c.out.empty()) {
+    ssize_t n =
+        send(c.fd, c.out.data(), c.out.size(), MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n <= 0) {
+      drop_client(c);
+      return;
+    }
+    c.out.erase(0, n);
+  }
+  if (c.out.size() > MAX_BACKLOG)
+    drop_client(c);
+  else if (c.closing && c.out.empty())
+    drop_client(c);
+  else
+    watch(c);
+}
+
+// Legacy clients get the bare text, errors prefixed, and are done
+static void reply(Client &c, uint32_t id, IpcStatus status,
+                  const std::string &text) {
+  if (c.fd < 0)
+    return;
+  if (c.legacy) {
+    if (status >= IPC_ERR_BAD_REQUEST)
+      c.out += "err: ";
+    c.out += text;
+    c.closing = true;
+  } else {
+    append_frame(c.out, id, status, text + '\0');
+  }
+  flush(c);
+}
+
+static void handle(Client &c, uint32_t id,
+                   const std::vector<std::string> &argv) {
+  const std::string &cmd = argv[0];
+  const std::string arg = argv.size() > 1 ? argv[1] : "";
+  IpcTicket ticket = {c.serial, id};
+  WAUL_TRACE_SCOPE("ipc");
+  log_msg(DEBUG, "IPC Recv: %s %s", cmd.c_str(), arg.c_str());
+
+  if (cmd == "ping") {
+    reply(c, id, IPC_OK, "pong");
+  } else if (cmd == "quit") {
+    Wayland::stop();
+    reply(c, id, IPC_OK, "bye");
+  } else if (cmd == "query") {
+    reply(c, id, IPC_OK, Wayland::get_current_wallpaper());
+  } else if (cmd == "set" || cmd == "set-async" || cmd == "preload") {
+    if (access(arg.c_str(), F_OK) != 0) {
+      log_msg(WARN, "IPC Request file not found: %s", arg.c_str());
+      reply(c, id, IPC_ERR_NOT_FOUND, "not found");
+    } else if (cmd == "preload") {
+      Wayland::preload(arg, ticket);
+    } else if (cmd == "set") {
+      // Answered once the frame is committed
+      Wayland::set_wallpaper(arg, ticket);
+    } else {
+      Wayland::set_wallpaper(arg);
+      reply(c, id, IPC_QUEUED, "queued");
+    }
+  } else if (cmd == "drop") {
+    Wayland::drop_preloads();
+    reply(c, id, IPC_OK, "ok");
+  } else if (cmd == "pause") {
+    Slideshow::pause();
+    reply(c, id, IPC_OK, "ok");
+  } else if (cmd == "resume") {
+    Slideshow::resume();
+    reply(c, id, IPC_OK, "ok");
+  } else if (cmd == "next") {
+    Slideshow::next();
+    reply(c, id, IPC_OK, "ok");
+  } else if (cmd == "status") {
+    reply(c, id, IPC_OK, Slideshow::status());
+  } else if (cmd == "stats") {
+    reply(c, id, IPC_OK, Stats::report(arg == "json"));
+  } else if (cmd == "palette") {
+    std::string text = PaletteCache::current(arg == "json");
+    if (text.empty())
+      reply(c, id, IPC_ERR_NOT_FOUND, "no palette");
+    else
+      reply(c, id, IPC_OK, text);
+  } else if (cmd == "trace" && arg == "on") {
+    std::string file =
+        argv.size() > 2 ? argv[2] : get_cache_dir() + "/trace.json";
+    if (Trace::start(file))
+      reply(c, id, IPC_OK, "tracing to " + file);
+    else
+      reply(c, id, IPC_ERR_BAD_REQUEST, "tracing not available");
+  } else if (cmd == "trace" && arg == "off") {
+    if (Trace::stop())
+      reply(c, id, IPC_OK, "trace written");
+    else
+      reply(c, id, IPC_ERR_NOT_FOUND, "no trace written");
+  } else if (cmd == "subscribe" && c.framed) {
+    c.subscribed = true;
+    reply(c, id, IPC_OK, "ok");
+    // Start subscribers off with what is on screen
+    if (!last_event.empty()) {
+      append_frame(c.out, 0, IPC_EVENT, last_event);
+      flush(c);
+    }
+  } else {
+    reply(c, id, IPC_ERR_BAD_REQUEST, "unknown command: " + cmd);
+  }
+}
+
+// "cmd|arg", everything after the first | being the argument
+static void handle_legacy(Client &c) {
+  std::string line = c.in;
+  c.in.clear();
+  while (!line.empty() && (line.back() == '\n' || line.back() == 0))
+    line.pop_back();
+  size_t bar = line.find('|');
+  std::vector<std::string> argv = {line.substr(0, bar)};
+  if (bar != std::string::npos)
+    argv.push_back(line.substr(bar + 1));
+  handle(c, 0, argv);
+  // Nothing more is read, even while a deferred answer is pending
+  watch(c);
+}
+
+static void handle_frames(Client &c) {
+  size_t pos = 0;
+  while (c.fd >= 0 && c.in.size() - pos >= sizeof(IpcHeader)) {
+    IpcHeader h;
+    memcpy(&h, c.in.data() + pos, sizeof(h));
+    if (memcmp(h.magic, IPC_MAGIC, 4) != 0 || h.len > IPC_MAX_PAYLOAD) {
+      log_msg(WARN, "IPC: malformed message, closing connection");
+      reply(c, h.id, IPC_ERR_BAD_REQUEST, "malformed message");
+      c.closing = true;
+      flush(c);
+      return;
+    }
+    if (c.in.size() - pos - sizeof(h) < h.len)
+      break;
+
+    // Fields are NUL terminated; a missing last terminator is forgiven
+    std::vector<std::string> argv;
+    const char *p = c.in.data() + pos + sizeof(h), *end = p + h.len;
+    while (p < end) {
+      const char *z = (const char *)memchr(p, 0, end - p);
+      if (!z)
+        z = end;
+      argv.emplace_back(p, z - p);
+      p = z + 1;
+    }
+    pos += sizeof(h) + h.len;
+    if (argv.empty())
+      reply(c, h.id, IPC_ERR_BAD_REQUEST, "empty request");
+    else
+      handle(c, h.id, argv);
+  }
+  c.in.erase(0, pos);
+}
+
+static void timed_out(void *data, uint32_t) {
+  Client &c = *(Client *)data;
+  c.deadline = 0;
+  log_msg(WARN, "IPC: client sent no complete request in %d ms, closing",
+          IPC_TIMEOUT_MS);
+  drop_client(c);
+}
+
+// Armed from the first byte of a request, or from accepting, until the
+// request is complete; not restarted by a client trickling it in
+static void update_deadline(Client &c) {
+  bool due = c.fd >= 0 && (!c.in.empty() || (!c.framed && !c.legacy));
+  if (due && !c.deadline) {
+    c.deadline = EventLoop::add_timer(EventLoop::now_ms() + IPC_TIMEOUT_MS,
+                                      timed_out, &c);
+  } else if (!due && c.deadline) {
+    EventLoop::cancel_timer(c.deadline);
+    c.deadline = 0;
+  }
+}
+
+static void read_client(Client &c) {
+  char buf[4096];
+  bool hung_up = false;
+  while (c.fd >= 0) {
+    ssize_t n = read(c.fd, buf, sizeof(buf));
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      break;
+    if (n < 0) {
+      drop_client(c);
+      return;
+    }
+    if (n == 0) {
+      hung_up = true;
+      break;
+    }
+    c.in.append(buf, n);
+  }
+  if (c.fd < 0)
+    return;
+
+  if (!c.framed && !c.legacy) {
+    size_t k = std::min(c.in.size(), sizeof(IPC_MAGIC));
+    if (memcmp(c.in.data(), IPC_MAGIC, k) != 0)
+      c.legacy = true;
+    else if (k == sizeof(IPC_MAGIC))
+      c.framed = true;
+  }
+  if (c.legacy)
+    handle_legacy(c);
+  else if (c.framed)
+    handle_frames(c);
+
+  // A legacy client that only half closed after its request still gets the
+  // answer, deferred or not: flush() closes it once the reply is out. Any
+  // other client that hung up is done.
+  if (hung_up && !c.legacy)
+    drop_client(c);
+  update_deadline(c);
+}
+
+static void on_client(void *data, uint32_t events) {
+  Client &c = *(Client *)data;
+  if (c.fd < 0)
+    return;
+  if (events & EPOLLOUT)
+    flush(c);
+  if (events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+    read_client(c);
+  if ((events & (EPOLLHUP | EPOLLERR)) && c.fd >= 0 && c.legacy &&
+      c.out.empty() && !c.closing)
+    drop_client(c); // gave up waiting for a deferred answer
+}
+
+static void on_accept(void *, uint32_t) {
+  while (true) {
+    int fd = accept4(server_fd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+      return;
+    if (clients.size() >= MAX_CLIENTS) {
+      log_msg(WARN, "IPC: too many clients, refusing one");
+      close(fd);
+      continue;
+    }
+    Client *c = new Client;
+    c->fd = fd;
+    c->serial = next_serial++;
+    if (next_serial == 0)
+      next_serial = 1;
+    c->events = EPOLLIN;
+    if (!EventLoop::add(fd, EPOLLIN, on_client, c)) {
+      close(fd);
+      delete c;
+      continue;
+    }
+    clients.push_back(c);
+    update_deadline(*c);
+  }
+}
+
+void ipc_collect() {
+  for (size_t i = 0; i < clients.size();) {
+    if (clients[i]->fd < 0) {
+      delete clients[i];
+      clients.erase(clients.begin() + i);
+    } else {
+      i++;
+    }
+  }
+}
+
+void ipc_shutdown() {
+  for (Client *c : clients) {
+    drop_client(*c);
+    delete c;
+  }
+  clients.clear();
+  if (server_fd >= 0) {
+    EventLoop::remove(server_fd);
+    close(server_fd);
+  }
+  server_fd = -1;
+}
+
+void ipc_reply(const IpcTicket &t, IpcStatus status, const std::string &text) {
+  if (t.client == 0)
+    return;
+  for (Client *c : clients) {
+    if (c->serial == t.client) {
+      reply(*c, t.id, status, text);
+      return;
+    }
+  }
+}
+
+void ipc_broadcast(const char *event, const std::string &arg) {
+  std::string payload = std::string(event) + '\0' + arg + '\0';
+  last_event = payload;
+  for (Client *c : clients) {
+    if (c->fd >= 0 && c->subscribed) {
+      append_frame(c->out, 0, IPC_EVENT, payload);
+      flush(*c);
     }
   }
-  close(fd);
 }
 
-} // namespace waul
\ No newline at end of file
+} // namespace waul
@@ -1,12 +1,73 @@
 #pragma once
+#include <cstdint>
 #include <string>
+#include <vector>
 
 namespace waul {
 
-int ipc_send_command(const std::string &cmd, bool wait_response = true);
+// Wire format, native byte order (the socket never leaves the machine).
+// Every message is a 16 byte header followed by len bytes of payload:
+//
+//   "WAUL" | u32 len | u32 id | u32 status
+//
+// Requests carry the command and its arguments, each NUL terminated, e.g.
+// "set\0/path/to/image.png\0", and status 0. Replies echo the request id and
+// carry a status and text. Connections stay open, so a client may pipeline
+// requests and match replies by id; replies to slow requests such as set can
+// arrive after those of later ones. After "subscribe" the daemon also pushes
+// IPC_EVENT messages with id 0, e.g. "wallpaper\0/path\0".
+//
+// A connection whose first bytes are not the magic is a legacy client: one
+// "cmd|arg" string, answered with bare text, then closed.
+constexpr char IPC_MAGIC[4] = {'W', 'A', 'U', 'L'};
+constexpr uint32_t IPC_MAX_PAYLOAD = 64 * 1024;
+
+enum IpcStatus : uint32_t {
+  IPC_OK = 0,
+  IPC_QUEUED = 1,
+  IPC_SUPERSEDED = 2, // a newer request replaced this one
+  IPC_DROPPED = 3,
+  IPC_EVENT = 16,
+  IPC_ERR_BAD_REQUEST = 32, // all errors are >= 32
+  IPC_ERR_NOT_FOUND = 33,
+  IPC_ERR_LIMIT = 34,
+  IPC_ERR_EXITING = 35,
+};
+
+struct IpcHeader {
+  char magic[4];
+  uint32_t len;
+  uint32_t id;
+  uint32_t status;
+};
+static_assert(sizeof(IpcHeader) == 16, "IPC header is 16 bytes on the wire");
+
+// Who to answer once a request completes later. Clients are numbered, not
+// identified by fd, so an answer never reaches a connection that reused it.
+struct IpcTicket {
+  uint32_t client = 0; // 0: nobody is waiting
+  uint32_t id = 0;
+};
+
+// Client side. Sends cmd with an optional argument and prints the reply.
+// Returns 0 on success, 1 if no daemon answered, 2 if it reported an error.
+int ipc_send_command(const std::string &cmd, const std::string &arg = "",
+                     bool wait_response = true);
+// Prints events until the daemon goes away
+int ipc_subscribe();
+
+// Listens and registers the socket and every client with the EventLoop.
+// A client has IPC_TIMEOUT_MS to send its first request and to finish any
+// request it started; idle connections between requests are kept.
+constexpr int IPC_TIMEOUT_MS = 5000;
 int ipc_server_init();
-int ipc_server_accept(int server_fd);
+// Frees connections closed since the last call. Call it between
+// EventLoop::wait()s, where nothing points at them.
+void ipc_collect();
+void ipc_shutdown();
 
-void ipc_handle_client(int client_fd);
+void ipc_reply(const IpcTicket &t, IpcStatus status, const std::string &text);
+// Sends an event to every subscribed client
+void ipc_broadcast(const char *event, const std::string &arg);
 
-} // namespace waul
\ No newline at end of file
+} // namespace waul
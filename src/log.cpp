@@ -0,0 +1,255 @@
+#include "common.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace waul {
+
+std::atomic<int> log_threshold{INFO};
+
+// Callers format straight into a slot of a bounded MPSC ring and go; one
+// thread drains it every flush interval and writes the lines in a single
+// write(2). A line longer than a slot is cut short, and a full ring drops
+// lines (counted) rather than block a caller.
+static constexpr size_t SLOTS = 512;
+static constexpr size_t LINE = 496;
+static constexpr size_t BATCH = 64 * 1024;
+
+// seq == position: free for the producer claiming it; position + 1: holds
+// a line for the writer; it goes back to position + SLOTS once written
+struct Slot {
+  std::atomic<uint64_t> seq;
+  uint32_t len;
+  char text[LINE];
+};
+
+static Slot ring[SLOTS];
+static std::atomic<uint64_t> tail{0}; // next position producers claim
+static std::atomic<uint64_t> head{0}; // next position the writer reads
+static std::atomic<uint64_t> dropped{0};
+static std::atomic<bool> urgent{false}; // flush without waiting the interval
+static std::atomic<bool> running{false};
+
+static std::atomic<int> flush_ms{500};
+static std::atomic<size_t> limit_bytes{4u << 20};
+
+static pthread_t writer;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake;
+static bool quit = false;
+
+static std::string path;
+static int fd = -1;
+static size_t size = 0;
+
+static const char *const tags[] = {"[DBG]", "[INF]", "[OK ]", "[WRN]",
+                                   "[ERR]"};
+
+// localtime() and strftime() once a second per thread, not per line
+static const char *timestamp() {
+  static thread_local time_t cached = -1;
+  static thread_local char buf[20];
+  timespec ts;
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  if (ts.tv_sec != cached) {
+    cached = ts.tv_sec;
+    tm t;
+    localtime_r(&cached, &t);
+    strftime(buf, sizeof(buf), "%Y-%m-%d %H:%M:%S", &t);
+  }
+  return buf;
+}
+
+static void open_log() {
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  struct stat st;
+  size = fd >= 0 && fstat(fd, &st) == 0 ? (size_t)st.st_size : 0;
+}
+
+// waul.log becomes waul.log.1, replacing the previous one
+static void rotate() {
+  close(fd);
+  rename(path.c_str(), (path + ".1").c_str());
+  open_log();
+}
+
+static void write_batch(const char *d, size_t len) {
+  if (len == 0 || fd < 0)
+    return;
+  size_t limit = limit_bytes.load(std::memory_order_relaxed);
+  if (limit && size > 0 && size + len > limit)
+    rotate();
+  if (fd < 0)
+    return;
+  for (size_t off = 0; off < len;) {
+    ssize_t n = write(fd, d + off, len - off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      break;
+    off += n;
+  }
+  size += len;
+}
+
+static void drain() {
+  static char batch[BATCH];
+  size_t len = 0;
+  uint64_t pos = head.load(std::memory_order_relaxed);
+  while (true) {
+    Slot &s = ring[pos % SLOTS];
+    if (s.seq.load(std::memory_order_acquire) != pos + 1)
+      break;
+    if (len + s.len > BATCH) {
+      write_batch(batch, len);
+      len = 0;
+    }
+    memcpy(batch + len, s.text, s.len);
+    len += s.len;
+    s.seq.store(pos + SLOTS, std::memory_order_release);
+    pos++;
+  }
+  head.store(pos, std::memory_order_relaxed);
+  uint64_t lost = dropped.exchange(0, std::memory_order_relaxed);
+  if (lost && len + LINE <= BATCH)
+    len += snprintf(batch + len, LINE, "%s %s %llu lines dropped, log full\n",
+                    timestamp(), tags[WARN], (unsigned long long)lost);
+  write_batch(batch, len);
+}
+
+static void *writer_main(void *) {
+  pthread_mutex_lock(&wake_lock);
+  while (!quit) {
+    // Nothing pending: sleep until a line arrives rather than every interval
+    if (tail.load(std::memory_order_acquire) ==
+        head.load(std::memory_order_relaxed)) {
+      pthread_cond_wait(&wake, &wake_lock);
+      continue;
+    }
+    if (urgent.exchange(false, std::memory_order_relaxed)) {
+      pthread_mutex_unlock(&wake_lock);
+      drain();
+      pthread_mutex_lock(&wake_lock);
+      continue;
+    }
+    timespec until;
+    clock_gettime(CLOCK_MONOTONIC, &until);
+    long ms = flush_ms.load(std::memory_order_relaxed);
+    until.tv_sec += ms / 1000;
+    until.tv_nsec += (ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&wake, &wake_lock, &until);
+    pthread_mutex_unlock(&wake_lock);
+    drain();
+    pthread_mutex_lock(&wake_lock);
+  }
+  pthread_mutex_unlock(&wake_lock);
+  drain();
+  return nullptr;
+}
+
+static void log_shutdown() {
+  if (!running.exchange(false))
+    return;
+  pthread_mutex_lock(&wake_lock);
+  quit = true;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&wake_lock);
+  pthread_join(writer, nullptr);
+  if (fd >= 0)
+    close(fd);
+  fd = -1;
+}
+
+void log_init() {
+  if (running.load())
+    return;
+  path = get_data_home_dir() + "/waul.log";
+  open_log();
+  if (fd < 0)
+    return;
+  for (size_t i = 0; i < SLOTS; i++)
+    ring[i].seq.store(i, std::memory_order_relaxed);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&wake, &attr);
+  pthread_condattr_destroy(&attr);
+  if (pthread_create(&writer, nullptr, writer_main, nullptr) != 0) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+  running.store(true, std::memory_order_release);
+  atexit(log_shutdown);
+}
+
+void log_configure(LogLevel level, int flush_interval_ms, int limit_mb) {
+  log_threshold.store(level, std::memory_order_relaxed);
+  flush_ms.store(flush_interval_ms > 0 ? flush_interval_ms : 1,
+                 std::memory_order_relaxed);
+  limit_bytes.store(limit_mb > 0 ? (size_t)limit_mb << 20 : 0,
+                    std::memory_order_relaxed);
+}
+
+void log_write(LogLevel level, const char *fmt, ...) {
+  if (!running.load(std::memory_order_acquire))
+    return;
+
+  uint64_t pos = tail.load(std::memory_order_relaxed);
+  Slot *s;
+  while (true) {
+    s = &ring[pos % SLOTS];
+    uint64_t seq = s->seq.load(std::memory_order_acquire);
+    if (seq == pos) {
+      if (tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+        break;
+    } else if (seq < pos) {
+      dropped.fetch_add(1, std::memory_order_relaxed);
+      return;
+    } else {
+      pos = tail.load(std::memory_order_relaxed);
+    }
+  }
+
+  int n = snprintf(s->text, LINE, "%s %s ", timestamp(), tags[level]);
+  va_list args;
+  va_start(args, fmt);
+  int m = vsnprintf(s->text + n, LINE - n, fmt, args);
+  va_end(args);
+  size_t len = m < 0 ? n : std::min((size_t)(n + m), LINE - 1);
+  s->text[len] = '\n';
+  s->len = len + 1;
+  s->seq.store(pos + 1, std::memory_order_release);
+
+  // The first line after the ring ran empty wakes the writer, under the
+  // lock so it cannot be missed while the writer goes to sleep. Errors
+  // reach the file now; anything else waits for the interval unless the
+  // ring is filling up.
+  int64_t backlog = pos - head.load(std::memory_order_relaxed);
+  bool hurry = level == ERROR || backlog >= (int64_t)SLOTS / 2;
+  if (hurry)
+    urgent.store(true, std::memory_order_relaxed);
+  if (backlog == 0) {
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&wake_lock);
+  } else if (hurry) {
+    pthread_cond_signal(&wake);
+  }
+}
+
+} // namespace waul
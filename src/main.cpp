@@ -1,35 +1,166 @@
 #include "common.hpp"
+#include "compositor.hpp"
+#include "config.hpp"
+#include "event_loop.hpp"
 #include "ipc.hpp"
+#include "trace.hpp"
 #include "wayland_backend.hpp"
+#include <algorithm>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <filesystem>
-#include <iostream>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
 
 using namespace waul;
 
 void print_help(bool is_error = false) {
-  std::ostream &out = is_error ? std::cerr : std::cout;
+  FILE *out = is_error ? stderr : stdout;
   if (is_error)
-    out << "Error: Invalid arguments\n\n";
-
-  out << "waul - Minimalist Wayland Wallpaper Daemon\n\n"
-      << "Usage: waul [OPTIONS]\n\n"
-      << "Options:\n"
-      << "  --set <path>    Set wallpaper (starts daemon if needed)\n"
-      << "  --query         Print current wallpaper path\n"
-      << "  --reload        Restart daemon\n"
-      << "  --quit          Stop daemon\n"
-      << "  --ping          Check if daemon is running\n"
-      << "  --version       Print version\n"
-      << "  --help          Show this help message\n";
+    fputs("Error: Invalid arguments\n\n", out);
+
+  fputs("waul - Minimalist Wayland Wallpaper Daemon\n\n"
+        "Usage: waul [OPTIONS]\n\n"
+        "Options:\n"
+        "  --set <path> [--async]\n"
+        "                  Set wallpaper (starts daemon if needed); waits\n"
+        "                  until it is on screen unless --async\n"
+        "  --preload <path>\n"
+        "                  Render a wallpaper ahead so a later --set of it\n"
+        "                  is instant\n"
+        "  --drop          Free preloaded wallpapers\n"
+        "  --query         Print current wallpaper path\n"
+        "  --next          Skip to the next slideshow image\n"
+        "  --pause         Pause the slideshow\n"
+        "  --resume        Resume the slideshow\n"
+        "  --status        Print slideshow state and position\n"
+        "  --subscribe     Print wallpaper changes as they happen\n"
+        "  --stats [--json]\n"
+        "                  Print render timings, counters and memory use\n"
+        "  --palette [--json]\n"
+        "                  Print the wallpaper's dominant, average, image\n"
+        "                  edge and palette colors\n"
+        "  --trace <file.json|off>\n"
+        "                  Record a timeline (chrome://tracing, Perfetto);\n"
+        "                  off writes it out\n"
+        "  --bench-query [runs]\n"
+        "                  Time --query end to end against the daemon\n"
+        "  --reload        Restart daemon\n"
+        "  --quit          Stop daemon\n"
+        "  --ping          Check if daemon is running\n"
+        "  --render <path> --size WxH --out <file.ppm>\n"
+        "                  Render offline to a PPM file (no compositor)\n"
+        "  --version       Print version\n"
+        "  --help          Show this help message\n",
+        out);
 }
 
-void print_version() { std::cout << "waul v0.1.0\n"; }
+void print_version() { puts("waul v0.1.0"); }
+
+// What std::filesystem::absolute() gives, without pulling it into the
+// client path
+static std::string absolute(const char *path) {
+  char cwd[PATH_MAX];
+  if (path[0] == '/' || !getcwd(cwd, sizeof(cwd)))
+    return path;
+  return std::string(cwd) + "/" + path;
+}
+
+static uint64_t now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Spawns `waul --query` runs times with its output discarded and reports
+// spawn-to-exit latency, the cost a status bar pays per refresh
+int run_bench_query(int argc, char **argv) {
+  int runs = argc > 2 ? atoi(argv[2]) : 200;
+  if (runs <= 0) {
+    print_help(true);
+    return 1;
+  }
+  if (ipc_send_command("ping", "", false) != 0) {
+    puts("Daemon not running.");
+    return 1;
+  }
+
+  char exe[PATH_MAX];
+  ssize_t n = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+  if (n <= 0)
+    return 1;
+  exe[n] = 0;
+
+  posix_spawn_file_actions_t fa;
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, "/dev/null", O_WRONLY,
+                                   0);
+  char arg0[] = "waul", arg1[] = "--query";
+  char *args[] = {arg0, arg1, nullptr};
+
+  std::vector<uint64_t> us;
+  us.reserve(runs);
+  for (int i = 0; i < runs; i++) {
+    uint64_t t0 = now_us();
+    pid_t pid;
+    int status = 0;
+    if (posix_spawn(&pid, exe, &fa, nullptr, args, environ) != 0 ||
+        waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      fputs("--query failed\n", stderr);
+      posix_spawn_file_actions_destroy(&fa);
+      return 1;
+    }
+    us.push_back(now_us() - t0);
+  }
+  posix_spawn_file_actions_destroy(&fa);
+
+  std::sort(us.begin(), us.end());
+  printf("--query x%d: min %llu us, median %llu us, p95 %llu us, max %llu "
+         "us\n",
+         runs, (unsigned long long)us[0],
+         (unsigned long long)us[us.size() / 2],
+         (unsigned long long)us[us.size() * 95 / 100],
+         (unsigned long long)us.back());
+  return 0;
+}
+
+int run_render(int argc, char **argv) {
+  std::string image = argv[2], out;
+  int w = 0, h = 0;
+  for (int i = 3; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "--size") == 0) {
+      if (sscanf(argv[i + 1], "%dx%d", &w, &h) != 2)
+        w = h = 0;
+    } else if (strcmp(argv[i], "--out") == 0) {
+      out = argv[i + 1];
+    }
+  }
+  if (w <= 0 || h <= 0 || out.empty()) {
+    print_help(true);
+    return 1;
+  }
 
-int main(int argc, char **argv) {
   log_init();
+  Config::load();
+  double ms = 0;
+  if (render_to_file(image, w, h, Config::get(), out, &ms) != 0) {
+    fputs("Render failed\n", stderr);
+    return 1;
+  }
+  printf("%dx%d composited in %.2f ms -> %s\n", w, h, ms, out.c_str());
+  return 0;
+}
+
+// Only the daemon and --render log; client verbs return before log_init()
+// so a bar polling --query does not touch the data dir on every call
+int main(int argc, char **argv) {
+  std::string trace_file; // for a daemon started by --trace
 
   if (argc > 1) {
     std::string action = argv[1];
@@ -40,15 +171,24 @@ int main(int argc, char **argv) {
     } else if (action == "--version" || action == "-v") {
       print_version();
       return 0;
+    } else if (action == "--render") {
+      if (argc < 3) {
+        print_help(true);
+        return 1;
+      }
+      return run_render(argc, argv);
+    } else if (action == "--bench-query") {
+      return run_bench_query(argc, argv);
     } else if (action == "--set") {
       if (argc < 3) {
         print_help(true);
         return 1;
       }
-      std::string path = std::filesystem::absolute(argv[2]);
+      std::string path = absolute(argv[2]);
+      bool async = argc > 3 && strcmp(argv[3], "--async") == 0;
 
-      if (ipc_send_command("set|" + path) != 0) {
-        std::cout << "Daemon not running, starting...\n";
+      if (ipc_send_command(async ? "set-async" : "set", path) == 1) {
+        puts("Daemon not running, starting...");
         if (fork() == 0) {
           setsid();
           std::string cache = get_cache_dir() + "/last_wall";
@@ -63,8 +203,20 @@ int main(int argc, char **argv) {
         return 0;
       }
       return 0;
-    } else if (action == "--reload") {
-      ipc_send_command("quit", false);
+    } else if (action == "--preload") {
+      if (argc < 3) {
+        print_help(true);
+        return 1;
+      }
+      std::string path = absolute(argv[2]);
+      int rc = ipc_send_command("preload", path);
+      if (rc == 1)
+        puts("Daemon not running.");
+      return rc;
+    } else if (action == "--drop")
+      return ipc_send_command("drop");
+    else if (action == "--reload") {
+      ipc_send_command("quit", "", false);
       usleep(200000);
       if (fork() == 0) {
         setsid();
@@ -75,9 +227,45 @@ int main(int argc, char **argv) {
       return ipc_send_command("quit");
     else if (action == "--query")
       return ipc_send_command("query");
+    else if (action == "--next")
+      return ipc_send_command("next");
+    else if (action == "--pause")
+      return ipc_send_command("pause");
+    else if (action == "--resume")
+      return ipc_send_command("resume");
+    else if (action == "--status")
+      return ipc_send_command("status");
+    else if (action == "--stats")
+      return ipc_send_command("stats",
+                              argc > 2 && strcmp(argv[2], "--json") == 0
+                                  ? "json"
+                                  : "");
+    else if (action == "--palette")
+      return ipc_send_command("palette",
+                              argc > 2 && strcmp(argv[2], "--json") == 0
+                                  ? "json"
+                                  : "");
+    else if (action == "--trace") {
+      if (argc < 3) {
+        print_help(true);
+        return 1;
+      }
+      if (strcmp(argv[2], "off") == 0)
+        return ipc_send_command("trace", "off");
+      trace_file = absolute(argv[2]);
+      if (ipc_send_command("trace", std::string("on") + '\0' + trace_file) != 1)
+        return 0;
+      puts("Daemon not running, starting...");
+      if (fork() == 0) {
+        setsid();
+        goto run_daemon;
+      }
+      return 0;
+    } else if (action == "--subscribe")
+      return ipc_subscribe();
     else if (action == "--ping") {
-      if (ipc_send_command("ping") != 0) {
-        std::cout << "Daemon not running.\n";
+      if (ipc_send_command("ping") == 1) {
+        puts("Daemon not running.");
         return 1;
       }
       return 0;
@@ -87,8 +275,8 @@ int main(int argc, char **argv) {
     }
   }
 
-  if (ipc_send_command("ping", false) == 0) {
-    std::cerr << "Daemon is already running.\n";
+  if (ipc_send_command("ping", "", false) == 0) {
+    fputs("Daemon is already running.\n", stderr);
     return 0;
   }
 
@@ -101,6 +289,12 @@ run_daemon:
   close(STDOUT_FILENO);
   close(STDERR_FILENO);
 
+  // Before any thread starts, so SIGTERM and SIGINT only reach the loop
+  if (!EventLoop::init())
+    return 1;
+  log_init();
+  if (!trace_file.empty())
+    Trace::start(trace_file);
   if (Wayland::init()) {
     Wayland::run();
   }
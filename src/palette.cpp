@@ -0,0 +1,276 @@
+#include "palette.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+namespace waul {
+
+static constexpr char MAGIC[8] = {'W', 'A', 'U', 'L', 'P', 'A', 'L', '1'};
+// Entries are under 100 bytes; past this many the oldest go
+static constexpr size_t MAX_ENTRIES = 512;
+// Colors closer than this (sum of channel differences) count as one
+static constexpr int MIN_DISTANCE = 48;
+
+struct Entry {
+  char magic[8];
+  uint64_t key;
+  Palette palette;
+};
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<uint64_t, Palette> memo;
+static Palette shown;
+static bool have_shown = false;
+
+static std::string cache_dir() {
+  static std::string dir;
+  if (dir.empty()) {
+    dir = get_cache_dir() + "/palettes";
+    ensure_dir(dir);
+  }
+  return dir;
+}
+
+static std::string entry_path(uint64_t key) {
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.pal", (unsigned long long)key);
+  return cache_dir() + name;
+}
+
+uint64_t PaletteCache::key(const std::string &path) {
+  struct stat st;
+  if (path.empty() || stat(path.c_str(), &st) != 0)
+    return 0;
+  uint64_t k = HASH_SEED;
+  hash_mix(k, path.data(), path.size());
+  hash_mix(k, &st.st_mtim.tv_sec, sizeof(st.st_mtim.tv_sec));
+  hash_mix(k, &st.st_mtim.tv_nsec, sizeof(st.st_mtim.tv_nsec));
+  hash_mix(k, &st.st_size, sizeof(st.st_size));
+  return k ? k : 1;
+}
+
+struct Sum {
+  uint64_t r = 0, g = 0, b = 0, n = 0;
+  void add(uint32_t r_, uint32_t g_, uint32_t b_) {
+    r += r_;
+    g += g_;
+    b += b_;
+    n++;
+  }
+  uint32_t mean() const {
+    if (!n)
+      return 0xFF000000;
+    return 0xFF000000 | (uint32_t)(r / n) << 16 | (uint32_t)(g / n) << 8 |
+           (uint32_t)(b / n);
+  }
+};
+
+static int distance(uint32_t a, uint32_t b) {
+  return abs((int)((a >> 16) & 0xFF) - (int)((b >> 16) & 0xFF)) +
+         abs((int)((a >> 8) & 0xFF) - (int)((b >> 8) & 0xFF)) +
+         abs((int)(a & 0xFF) - (int)(b & 0xFF));
+}
+
+// A 12-bit color histogram, the overall average and the four edge bands
+// are gathered in the same pass. Colors are the means of the fullest bins,
+// skipping any too close to one already picked.
+void PaletteCache::extract(const Image &img, Palette &out) {
+  out = Palette();
+  if (!img.pixels || img.w <= 0 || img.h <= 0)
+    return;
+
+  int step = 1;
+  while ((int64_t)(img.w / step) * (img.h / step) > 256 * 256)
+    step++;
+  // Bands a sixteenth of the image deep, at least one sample
+  int bx = std::max(step, img.w / 16), by = std::max(step, img.h / 16);
+
+  std::vector<Sum> bins(4096);
+  Sum all, edge[4];
+  for (int y = 0; y < img.h; y += step) {
+    const uint32_t *row = img.pixels + (size_t)y * img.w;
+    bool top = y < by, bottom = y >= img.h - by;
+    for (int x = 0; x < img.w; x += step) {
+      uint32_t p = row[x];
+      uint32_t r = (p >> 16) & 0xFF, g = (p >> 8) & 0xFF, b = p & 0xFF;
+      bins[(r >> 4) << 8 | (g >> 4) << 4 | b >> 4].add(r, g, b);
+      all.add(r, g, b);
+      if (top)
+        edge[0].add(r, g, b);
+      if (x >= img.w - bx)
+        edge[1].add(r, g, b);
+      if (bottom)
+        edge[2].add(r, g, b);
+      if (x < bx)
+        edge[3].add(r, g, b);
+    }
+  }
+
+  out.average = all.mean();
+  for (int i = 0; i < 4; i++)
+    out.edges[i] = edge[i].mean();
+
+  std::vector<int> order;
+  for (int i = 0; i < 4096; i++) {
+    if (bins[i].n)
+      order.push_back(i);
+  }
+  std::sort(order.begin(), order.end(),
+            [&](int a, int b) { return bins[a].n > bins[b].n; });
+  for (int i : order) {
+    if (out.count == Palette::MAX_COLORS)
+      break;
+    uint32_t c = bins[i].mean();
+    bool distinct = true;
+    for (int k = 0; k < out.count && distinct; k++)
+      distinct = distance(c, out.colors[k]) >= MIN_DISTANCE;
+    if (distinct)
+      out.colors[out.count++] = c;
+  }
+}
+
+bool PaletteCache::find(uint64_t key, Palette &out) {
+  if (!key)
+    return false;
+  pthread_mutex_lock(&lock);
+  auto it = memo.find(key);
+  bool found = it != memo.end();
+  if (found)
+    out = it->second;
+  pthread_mutex_unlock(&lock);
+  if (found)
+    return true;
+
+  Entry e;
+  FILE *f = fopen(entry_path(key).c_str(), "rb");
+  if (!f)
+    return false;
+  bool ok = fread(&e, sizeof(e), 1, f) == 1 &&
+            memcmp(e.magic, MAGIC, sizeof(MAGIC)) == 0 && e.key == key &&
+            e.palette.count >= 0 && e.palette.count <= Palette::MAX_COLORS;
+  fclose(f);
+  if (!ok)
+    return false;
+  out = e.palette;
+  pthread_mutex_lock(&lock);
+  memo[key] = out;
+  pthread_mutex_unlock(&lock);
+  return true;
+}
+
+struct File {
+  std::string name;
+  time_t mtime;
+};
+
+static void evict() {
+  DIR *d = opendir(cache_dir().c_str());
+  if (!d)
+    return;
+  std::vector<File> files;
+  while (dirent *e = readdir(d)) {
+    struct stat st;
+    size_t len = strlen(e->d_name);
+    if (len > 4 && strcmp(e->d_name + len - 4, ".pal") == 0 &&
+        fstatat(dirfd(d), e->d_name, &st, 0) == 0)
+      files.push_back(File{e->d_name, st.st_mtime});
+  }
+  if (files.size() > MAX_ENTRIES) {
+    std::sort(files.begin(), files.end(),
+              [](const File &a, const File &b) { return a.mtime < b.mtime; });
+    for (size_t i = 0; i < files.size() - MAX_ENTRIES; i++)
+      unlinkat(dirfd(d), files[i].name.c_str(), 0);
+  }
+  closedir(d);
+}
+
+void PaletteCache::store(uint64_t key, const Palette &p) {
+  if (!key)
+    return;
+  pthread_mutex_lock(&lock);
+  // Only a handful are in play at once: the image on screen, a preload and
+  // the next slideshow image
+  if (memo.size() >= 64)
+    memo.clear();
+  memo[key] = p;
+  pthread_mutex_unlock(&lock);
+
+  Entry e{};
+  memcpy(e.magic, MAGIC, sizeof(MAGIC));
+  e.key = key;
+  e.palette = p;
+  std::string path = entry_path(key), tmp = path + ".tmp";
+  FILE *f = fopen(tmp.c_str(), "wb");
+  if (!f)
+    return;
+  bool ok = fwrite(&e, sizeof(e), 1, f) == 1;
+  if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return;
+  }
+  evict();
+}
+
+static std::string hex(uint32_t c) {
+  char buf[8];
+  snprintf(buf, sizeof(buf), "#%06x", c & 0xFFFFFF);
+  return buf;
+}
+
+static std::string format(const Palette &p, bool json) {
+  std::string s;
+  if (json) {
+    s = "{\"dominant\":\"" + hex(p.colors[0]) + "\",\"average\":\"" +
+        hex(p.average) + "\",\"edges\":{";
+    const char *side[4] = {"top", "right", "bottom", "left"};
+    for (int i = 0; i < 4; i++)
+      s += std::string(i ? "," : "") + "\"" + side[i] + "\":\"" +
+           hex(p.edges[i]) + "\"";
+    s += "},\"colors\":[";
+    for (int i = 0; i < p.count; i++)
+      s += std::string(i ? "," : "") + "\"" + hex(p.colors[i]) + "\"";
+    return s + "]}";
+  }
+  s = "dominant " + hex(p.colors[0]) + "\naverage " + hex(p.average) +
+      "\nedges";
+  for (int i = 0; i < 4; i++)
+    s += " " + hex(p.edges[i]);
+  s += "\ncolors";
+  for (int i = 0; i < p.count; i++)
+    s += " " + hex(p.colors[i]);
+  return s;
+}
+
+bool PaletteCache::show(const std::string &path) {
+  have_shown = find(key(path), shown);
+  std::string file = get_cache_dir() + "/palette";
+  if (!have_shown) {
+    unlink(file.c_str());
+    return false;
+  }
+
+  std::string tmp = file + ".tmp", text = format(shown, false) + "\n";
+  FILE *f = fopen(tmp.c_str(), "w");
+  if (!f)
+    return true;
+  bool ok = fputs(text.c_str(), f) >= 0;
+  if (fclose(f) != 0 || !ok || rename(tmp.c_str(), file.c_str()) != 0)
+    unlink(tmp.c_str());
+  return true;
+}
+
+std::string PaletteCache::current(bool json) {
+  return have_shown ? format(shown, json) : "";
+}
+
+} // namespace waul
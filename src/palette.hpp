@@ -0,0 +1,43 @@
+#pragma once
+#include "compositor.hpp"
+#include <cstdint>
+#include <string>
+
+namespace waul {
+
+// Colors of a wallpaper for bars and terminal themes. XRGB8888.
+struct Palette {
+  static constexpr int MAX_COLORS = 8;
+  uint32_t colors[MAX_COLORS] = {}; // Most common first; colors[0] dominates
+  int count = 0;
+  uint32_t average = 0;
+  // Averages of the top, right, bottom and left bands of the source image,
+  // not of the screen: margins, borders and fit modes are left out, since
+  // a palette is kept per image rather than per output and layout.
+  uint32_t edges[4] = {};
+};
+
+// Palettes are extracted on the render thread from the decoded image it
+// already holds, kept per image under get_cache_dir()/palettes, and the one
+// on screen is written to get_cache_dir()/palette, so theming tools never
+// decode the wallpaper themselves.
+class PaletteCache {
+public:
+  // Identifies path's current contents; 0 if it cannot be read
+  static uint64_t key(const std::string &path);
+
+  // One pass over at most 256 x 256 evenly spaced pixels
+  static void extract(const Image &img, Palette &out);
+
+  // Safe from the render thread while the main thread reads
+  static bool find(uint64_t key, Palette &out);
+  static void store(uint64_t key, const Palette &p);
+
+  // Makes path's palette the current one and rewrites the palette file.
+  // False if none was extracted for it.
+  static bool show(const std::string &path);
+  // The current palette as text lines, or JSON; "" if there is none
+  static std::string current(bool json);
+};
+
+} // namespace waul
@@ -0,0 +1,258 @@
+#include "pixel_ops.hpp"
+#include "common.hpp"
+
+#include <cstdlib>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+namespace waul {
+
+static inline uint32_t swizzle_px(const uint8_t *p) {
+  return 0xFF000000 | (p[0] << 16) | (p[1] << 8) | p[2];
+}
+
+// Scalar
+
+static void swizzle_scalar(uint32_t *dst, const uint8_t *src, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = swizzle_px(src + i * 4);
+}
+
+static void fill_scalar(uint32_t *dst, uint32_t color, size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = color;
+}
+
+static void blend_scalar(uint32_t *dst, uint32_t color, const uint8_t *cov,
+                         size_t n) {
+  for (size_t i = 0; i < n; i++)
+    dst[i] = blend_px(dst[i], color, cov_weight(cov[i]));
+}
+
+static const PixelOps scalar_ops = {"scalar", swizzle_scalar, fill_scalar,
+                                    blend_scalar};
+
+#if defined(__x86_64__)
+
+// SSE2 (x86-64 baseline)
+
+static void swizzle_sse2(uint32_t *dst, const uint8_t *src, size_t n) {
+  const __m128i lo = _mm_set1_epi32(0xFF), mid = _mm_set1_epi32(0xFF00);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(src + i * 4));
+    __m128i r = _mm_slli_epi32(_mm_and_si128(v, lo), 16);
+    __m128i g = _mm_and_si128(v, mid);
+    __m128i b = _mm_and_si128(_mm_srli_epi32(v, 16), lo);
+    __m128i o = _mm_or_si128(_mm_or_si128(r, g), _mm_or_si128(b, alpha));
+    _mm_storeu_si128((__m128i *)(dst + i), o);
+  }
+  swizzle_scalar(dst + i, src + i * 4, n - i);
+}
+
+static void fill_sse2(uint32_t *dst, uint32_t color, size_t n) {
+  const __m128i c = _mm_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    _mm_storeu_si128((__m128i *)(dst + i), c);
+  fill_scalar(dst + i, color, n - i);
+}
+
+static void blend_sse2(uint32_t *dst, uint32_t color, const uint8_t *cov,
+                       size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i mask = _mm_set1_epi32(0x00FF00FF);
+  const __m128i g_mask = _mm_set1_epi32(0xFF);
+  const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+  const __m128i full = _mm_set1_epi16(256);
+  const __m128i rb_c = _mm_set1_epi32(color & 0x00FF00FF);
+  const __m128i g_c = _mm_set1_epi32((color >> 8) & 0x00FF00FF);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32_t c4;
+    memcpy(&c4, cov + i, 4);
+    __m128i a = _mm_cvtsi32_si128((int)c4);
+    a = _mm_unpacklo_epi16(_mm_unpacklo_epi8(a, zero), zero);
+    a = _mm_add_epi32(a, _mm_srli_epi32(a, 7));
+    __m128i w = _mm_or_si128(a, _mm_slli_epi32(a, 16));
+    __m128i iw = _mm_sub_epi16(full, w);
+
+    __m128i px = _mm_loadu_si128((const __m128i *)(dst + i));
+    __m128i rb_s = _mm_and_si128(px, mask);
+    __m128i g_s = _mm_and_si128(_mm_srli_epi32(px, 8), mask);
+    __m128i rb = _mm_srli_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(rb_s, iw), _mm_mullo_epi16(rb_c, w)), 8);
+    __m128i g = _mm_srli_epi16(
+        _mm_add_epi16(_mm_mullo_epi16(g_s, iw), _mm_mullo_epi16(g_c, w)), 8);
+    g = _mm_slli_epi32(_mm_and_si128(g, g_mask), 8);
+    _mm_storeu_si128((__m128i *)(dst + i),
+                     _mm_or_si128(_mm_or_si128(rb, g), alpha));
+  }
+  blend_scalar(dst + i, color, cov + i, n - i);
+}
+
+static const PixelOps sse2_ops = {"sse2", swizzle_sse2, fill_sse2,
+                                  blend_sse2};
+
+// AVX2
+
+__attribute__((target("avx2"))) static void
+swizzle_avx2(uint32_t *dst, const uint8_t *src, size_t n) {
+  const __m256i shuf =
+      _mm256_setr_epi8(2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1,
+                       2, 1, 0, -1, 6, 5, 4, -1, 10, 9, 8, -1, 14, 13, 12, -1);
+  const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(src + i * 4));
+    v = _mm256_or_si256(_mm256_shuffle_epi8(v, shuf), alpha);
+    _mm256_storeu_si256((__m256i *)(dst + i), v);
+  }
+  swizzle_sse2(dst + i, src + i * 4, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+fill_avx2(uint32_t *dst, uint32_t color, size_t n) {
+  const __m256i c = _mm256_set1_epi32((int)color);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8)
+    _mm256_storeu_si256((__m256i *)(dst + i), c);
+  fill_sse2(dst + i, color, n - i);
+}
+
+__attribute__((target("avx2"))) static void
+blend_avx2(uint32_t *dst, uint32_t color, const uint8_t *cov, size_t n) {
+  const __m256i mask = _mm256_set1_epi32(0x00FF00FF);
+  const __m256i g_mask = _mm256_set1_epi32(0xFF);
+  const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+  const __m256i full = _mm256_set1_epi16(256);
+  const __m256i rb_c = _mm256_set1_epi32(color & 0x00FF00FF);
+  const __m256i g_c = _mm256_set1_epi32((color >> 8) & 0x00FF00FF);
+  size_t i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256i a =
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(cov + i)));
+    a = _mm256_add_epi32(a, _mm256_srli_epi32(a, 7));
+    __m256i w = _mm256_or_si256(a, _mm256_slli_epi32(a, 16));
+    __m256i iw = _mm256_sub_epi16(full, w);
+
+    __m256i px = _mm256_loadu_si256((const __m256i *)(dst + i));
+    __m256i rb_s = _mm256_and_si256(px, mask);
+    __m256i g_s = _mm256_and_si256(_mm256_srli_epi32(px, 8), mask);
+    __m256i rb = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(rb_s, iw),
+                         _mm256_mullo_epi16(rb_c, w)),
+        8);
+    __m256i g = _mm256_srli_epi16(
+        _mm256_add_epi16(_mm256_mullo_epi16(g_s, iw),
+                         _mm256_mullo_epi16(g_c, w)),
+        8);
+    g = _mm256_slli_epi32(_mm256_and_si256(g, g_mask), 8);
+    _mm256_storeu_si256((__m256i *)(dst + i),
+                        _mm256_or_si256(_mm256_or_si256(rb, g), alpha));
+  }
+  blend_sse2(dst + i, color, cov + i, n - i);
+}
+
+static const PixelOps avx2_ops = {"avx2", swizzle_avx2, fill_avx2,
+                                  blend_avx2};
+
+#elif defined(__aarch64__)
+
+// NEON (mandatory on aarch64)
+
+static void swizzle_neon(uint32_t *dst, const uint8_t *src, size_t n) {
+  const uint8x16_t alpha = vdupq_n_u8(0xFF);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    uint8x16x4_t v = vld4q_u8(src + i * 4);
+    uint8x16x4_t o = {{v.val[2], v.val[1], v.val[0], alpha}};
+    vst4q_u8((uint8_t *)(dst + i), o);
+  }
+  swizzle_scalar(dst + i, src + i * 4, n - i);
+}
+
+static void fill_neon(uint32_t *dst, uint32_t color, size_t n) {
+  const uint32x4_t c = vdupq_n_u32(color);
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4)
+    vst1q_u32(dst + i, c);
+  fill_scalar(dst + i, color, n - i);
+}
+
+static void blend_neon(uint32_t *dst, uint32_t color, const uint8_t *cov,
+                       size_t n) {
+  const uint32x4_t mask = vdupq_n_u32(0x00FF00FF);
+  const uint32x4_t g_mask = vdupq_n_u32(0xFF);
+  const uint32x4_t alpha = vdupq_n_u32(0xFF000000);
+  const uint16x8_t full = vdupq_n_u16(256);
+  const uint16x8_t rb_c = vreinterpretq_u16_u32(vdupq_n_u32(color & 0x00FF00FF));
+  const uint16x8_t g_c =
+      vreinterpretq_u16_u32(vdupq_n_u32((color >> 8) & 0x00FF00FF));
+  size_t i = 0;
+  for (; i + 4 <= n; i += 4) {
+    uint32_t c4;
+    memcpy(&c4, cov + i, 4);
+    uint32x4_t a = vmovl_u16(vget_low_u16(vmovl_u8(vcreate_u8(c4))));
+    a = vaddq_u32(a, vshrq_n_u32(a, 7));
+    uint16x8_t w = vreinterpretq_u16_u32(vorrq_u32(a, vshlq_n_u32(a, 16)));
+    uint16x8_t iw = vsubq_u16(full, w);
+
+    uint32x4_t px = vld1q_u32(dst + i);
+    uint16x8_t rb_s = vreinterpretq_u16_u32(vandq_u32(px, mask));
+    uint16x8_t g_s = vreinterpretq_u16_u32(vandq_u32(vshrq_n_u32(px, 8), mask));
+    uint32x4_t rb = vreinterpretq_u32_u16(
+        vshrq_n_u16(vmlaq_u16(vmulq_u16(rb_s, iw), rb_c, w), 8));
+    uint32x4_t g = vreinterpretq_u32_u16(
+        vshrq_n_u16(vmlaq_u16(vmulq_u16(g_s, iw), g_c, w), 8));
+    g = vshlq_n_u32(vandq_u32(g, g_mask), 8);
+    vst1q_u32(dst + i, vorrq_u32(vorrq_u32(rb, g), alpha));
+  }
+  blend_scalar(dst + i, color, cov + i, n - i);
+}
+
+static const PixelOps neon_ops = {"neon", swizzle_neon, fill_neon,
+                                  blend_neon};
+
+#endif
+
+int pixel_ops_supported(const PixelOps **out) {
+  int count = 0;
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    out[count++] = &avx2_ops;
+  out[count++] = &sse2_ops;
+#elif defined(__aarch64__)
+  out[count++] = &neon_ops;
+#endif
+  out[count++] = &scalar_ops;
+  return count;
+}
+
+static PixelOps select_ops() {
+  const PixelOps *candidates[PIXEL_OPS_MAX] = {};
+  int count = pixel_ops_supported(candidates);
+
+  const PixelOps *ops = candidates[0];
+  const char *force = getenv("WAUL_PIXEL_OPS");
+  for (int i = 0; force && i < count; i++) {
+    if (strcmp(force, candidates[i]->name) == 0)
+      ops = candidates[i];
+  }
+  log_msg(DEBUG, "Pixel kernels: %s", ops->name);
+  return *ops;
+}
+
+const PixelOps &pixel_ops() {
+  static const PixelOps ops = select_ops();
+  return ops;
+}
+
+} // namespace waul
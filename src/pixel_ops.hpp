@@ -0,0 +1,37 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+namespace waul {
+
+// Blends s towards c by a/256 per channel, a in [0, 256]. Every kernel
+// below uses exactly this arithmetic so all paths are bit-identical.
+inline uint32_t blend_px(uint32_t s, uint32_t c, uint32_t a) {
+  uint32_t ia = 256 - a;
+  uint32_t rb = (((s & 0xFF00FF) * ia + (c & 0xFF00FF) * a) >> 8) & 0xFF00FF;
+  uint32_t g = ((((s >> 8) & 0xFF) * ia + ((c >> 8) & 0xFF) * a) >> 8) & 0xFF;
+  return 0xFF000000 | rb | (g << 8);
+}
+
+// Maps 8-bit coverage to the [0, 256] weight blend_px expects.
+inline uint32_t cov_weight(uint8_t cov) { return cov + (cov >> 7); }
+
+struct PixelOps {
+  const char *name;
+  // RGBA8888 bytes to XRGB8888 words. dst may alias src.
+  void (*swizzle)(uint32_t *dst, const uint8_t *src, size_t n);
+  void (*fill)(uint32_t *dst, uint32_t color, size_t n);
+  // dst[i] = blend_px(dst[i], color, cov_weight(cov[i]))
+  void (*blend)(uint32_t *dst, uint32_t color, const uint8_t *cov, size_t n);
+};
+
+// Kernels for the running CPU, picked once on first use. Setting
+// WAUL_PIXEL_OPS=scalar forces the portable fallback.
+const PixelOps &pixel_ops();
+
+// Fills out with every kernel set the running CPU can use, best first and
+// the scalar reference last, and returns how many there are.
+constexpr int PIXEL_OPS_MAX = 3;
+int pixel_ops_supported(const PixelOps **out);
+
+} // namespace waul
@@ -1,20 +1,28 @@
 #include "renderer.hpp"
 #include "common.hpp"
+#include "compositor.hpp"
 #include "config.hpp"
+#include "decoder.hpp"
+#include "frame_cache.hpp"
+#include "palette.hpp"
+#include "stats.hpp"
+#include "trace.hpp"
 
 #include <algorithm>
-#include <cmath>
+#include <atomic>
+#include <cstring>
 #include <fcntl.h>
 #include <malloc.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
-
-#define STB_IMAGE_IMPLEMENTATION
-#include <stb/stb_image.h>
+#include <vector>
 
 namespace waul {
 
-Buffer Renderer::buf;
 wl_shm *Renderer::shm_ref = nullptr;
 
 static int create_shm_file(size_t size) {
@@ -30,210 +38,702 @@ static int create_shm_file(size_t size) {
 
 void Renderer::init(wl_shm *shm) { shm_ref = shm; }
 
-void Renderer::cleanup() {
-  if (buf.wlbuf)
-    wl_buffer_destroy(buf.wlbuf);
-  if (buf.fd != -1)
-    close(buf.fd);
-  buf.wlbuf = nullptr;
-  buf.fd = -1;
+static void buffer_release(void *data, wl_buffer *) {
+  ((Slot *)data)->busy = false;
+}
+
+static const wl_buffer_listener buffer_listener = {.release = buffer_release};
+
+static void wait_stored();
+
+// Grows the pool's file, mapping and wl_shm_pool to at least bytes
+static bool reserve(wl_shm *shm, BufferPool &pool, size_t bytes) {
+  if (bytes <= pool.size)
+    return true;
+  wait_stored();
+
+  WAUL_TRACE_SCOPE("mmap");
+  if (pool.fd == -1) {
+    pool.fd = create_shm_file(bytes);
+    if (pool.fd < 0)
+      return false;
+    void *data =
+        mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, pool.fd, 0);
+    if (data == MAP_FAILED) {
+      close(pool.fd);
+      pool.fd = -1;
+      return false;
+    }
+    pool.data = (uint8_t *)data;
+    pool.pool = wl_shm_create_pool(shm, pool.fd, bytes);
+  } else {
+    if (ftruncate(pool.fd, bytes) < 0)
+      return false;
+    void *data = mremap(pool.data, pool.size, bytes, MREMAP_MAYMOVE);
+    if (data == MAP_FAILED)
+      return false;
+    pool.data = (uint8_t *)data;
+    wl_shm_pool_resize(pool.pool, bytes);
+  }
+  Stats::add(STAT_SHM_BYTES, bytes - pool.size);
+  pool.size = bytes;
+  return true;
+}
+
+static bool add_slot(wl_shm *shm, BufferPool &pool) {
+  size_t offset = pool.nslots * pool.slot_size();
+  if (pool.nslots == BufferPool::MAX_SLOTS ||
+      !reserve(shm, pool, offset + pool.slot_size()))
+    return false;
+
+  Slot &s = pool.slots[pool.nslots++];
+  s.offset = offset;
+  s.busy = false;
+  s.wlbuf = wl_shm_pool_create_buffer(pool.pool, offset, pool.w, pool.h,
+                                      pool.w * 4, WL_SHM_FORMAT_XRGB8888);
+  wl_buffer_add_listener(s.wlbuf, &buffer_listener, &s);
+  Stats::add(STAT_BUFFERS);
+  return true;
+}
+
+static void release_slots(BufferPool &pool) {
+  for (int i = 0; i < pool.nslots; i++) {
+    wl_buffer_destroy(pool.slots[i].wlbuf);
+    pool.slots[i] = Slot();
+  }
+  Stats::add(STAT_BUFFERS, -pool.nslots);
+  pool.nslots = 0;
+  pool.front = 0;
+}
+
+static bool same_colors(const ConfigState &a, const ConfigState &b) {
+  return memcmp(a.bg, b.bg, sizeof(a.bg)) == 0 &&
+         memcmp(a.bc, b.bc, sizeof(a.bc)) == 0;
 }
 
-void Renderer::resize_buffer(int w, int h) {
-  cleanup();
-  buf.w = w;
-  buf.h = h;
-  int stride = w * 4;
-  buf.size = stride * h;
-  buf.fd = create_shm_file(buf.size);
+// A free slot, adding one when the compositor still holds all of them. A
+// preloaded frame is only given up when nothing else is left, and a buffer
+// the compositor holds never: null until one comes back.
+static Slot *acquire_slot(wl_shm *shm, BufferPool &pool) {
+  if (pool.nslots == 0)
+    return nullptr;
+  for (int i = 0; i < pool.nslots; i++) {
+    if (!pool.slots[i].busy && !pool.slots[i].preloaded)
+      return &pool.slots[i];
+  }
+  if (add_slot(shm, pool))
+    return &pool.slots[pool.nslots - 1];
+  for (int i = 0; i < pool.nslots; i++) {
+    if (!pool.slots[i].busy)
+      return &pool.slots[i];
+  }
+  log_msg(DEBUG, "No free buffer, waiting for a release");
+  return nullptr;
+}
+
+bool Renderer::has_free_slot(const BufferPool &pool) {
+  for (int i = 0; i < pool.nslots; i++) {
+    if (!pool.slots[i].busy)
+      return true;
+  }
+  return false;
+}
 
-  if (buf.fd >= 0) {
-    wl_shm_pool *pool = wl_shm_create_pool(shm_ref, buf.fd, buf.size);
-    buf.wlbuf = wl_shm_pool_create_buffer(pool, 0, w, h, stride,
-                                          WL_SHM_FORMAT_XRGB8888);
-    wl_shm_pool_destroy(pool);
+// Where to preload into: the previous preload, else any free slot but the
+// one on screen. Speculative work never takes a busy slot.
+static Slot *acquire_spare(wl_shm *shm, BufferPool &pool) {
+  Slot *spare = nullptr;
+  for (int i = 0; i < pool.nslots; i++) {
+    Slot &s = pool.slots[i];
+    if (s.busy || i == pool.front)
+      continue;
+    if (s.preloaded)
+      return &s;
+    if (!spare)
+      spare = &s;
   }
+  if (!spare && add_slot(shm, pool))
+    spare = &pool.slots[pool.nslots - 1];
+  return spare;
 }
 
-static uint32_t blend(uint32_t c1, uint32_t c2, float factor) {
-  int r1 = (c1 >> 16) & 0xFF, g1 = (c1 >> 8) & 0xFF, b1 = c1 & 0xFF;
-  int r2 = (c2 >> 16) & 0xFF, g2 = (c2 >> 8) & 0xFF, b2 = c2 & 0xFF;
+// Only the latest preload is kept
+static void keep_preload(BufferPool &pool, const Slot *slot) {
+  for (int i = 0; i < pool.nslots; i++)
+    pool.slots[i].preloaded = &pool.slots[i] == slot;
+}
 
-  int r = r1 + (r2 - r1) * factor;
-  int g = g1 + (g2 - g1) * factor;
-  int b = b1 + (b2 - b1) * factor;
+// A slot behind the screen that already holds exactly this frame
+static Slot *find_ready(BufferPool &pool, uint64_t content,
+                        const ConfigState &cfg) {
+  for (int i = 0; i < pool.nslots; i++) {
+    Slot &s = pool.slots[i];
+    if (i != pool.front && !s.busy && s.content == content &&
+        same_colors(s.cfg, cfg))
+      return &s;
+  }
+  return nullptr;
+}
 
-  return (0xFF << 24) | (r << 16) | (g << 8) | b;
+// A free slot behind the screen holding this content in other colors: a
+// recolor only has to repaint what differs
+static Slot *find_recolorable(BufferPool &pool, uint64_t content) {
+  for (int i = 0; i < pool.nslots; i++) {
+    Slot &s = pool.slots[i];
+    if (i != pool.front && !s.busy && !s.preloaded && s.content == content)
+      return &s;
+  }
+  return nullptr;
 }
 
-static uint32_t mix_alpha(int r, int g, int b, int a, uint32_t bg) {
-  if (a == 0)
-    return bg;
-  if (a == 255)
-    return (0xFF << 24) | (r << 16) | (g << 8) | b;
-  return blend(bg, (0xFF << 24) | (r << 16) | (g << 8) | b, a / 255.0f);
+void Renderer::destroy_pool(BufferPool &pool) {
+  WAUL_TRACE_SCOPE("munmap");
+  wait_stored();
+  release_slots(pool);
+  if (pool.pool)
+    wl_shm_pool_destroy(pool.pool);
+  if (pool.data)
+    munmap(pool.data, pool.size);
+  Stats::add(STAT_SHM_BYTES, -(int64_t)pool.size);
+  if (pool.fd != -1)
+    close(pool.fd);
+  pool = BufferPool();
 }
 
-void Renderer::draw(const std::string &path, wl_surface *surf) {
-  if (buf.fd == -1)
+void Renderer::resize_pool(BufferPool &pool, int w, int h) {
+  if (pool.w == w && pool.h == h && pool.nslots > 0)
     return;
+  release_slots(pool);
+
+  // Pools only grow, so a much smaller output starts over with a new one
+  size_t need = BufferPool::DEFAULT_SLOTS * (size_t)w * h * 4;
+  if (pool.size > 2 * need)
+    destroy_pool(pool);
+
+  pool.w = w;
+  pool.h = h;
+  reserve(shm_ref, pool, need);
+  for (int i = 0; i < BufferPool::DEFAULT_SLOTS; i++) {
+    if (!add_slot(shm_ref, pool))
+      log_msg(ERROR, "Could not allocate %dx%d buffer", w, h);
+  }
+}
+
+// Identifies what the image area of a frame holds: the source file as it is
+// on disk, placed with cfg's layout into a w x h buffer
+static uint64_t content_id(const std::string &path, const ConfigState &cfg,
+                           int w, int h) {
+  struct stat st = {};
+  stat(path.c_str(), &st);
+  uint64_t k = Config::layout_hash(cfg);
+  hash_mix(k, path.data(), path.size());
+  hash_mix(k, &st.st_mtim, sizeof(st.st_mtim));
+  hash_mix(k, &st.st_size, sizeof(st.st_size));
+  hash_mix(k, &w, sizeof(w));
+  hash_mix(k, &h, sizeof(h));
+  return k ? k : 1;
+}
+
+// One target's frame in a draw and the part of it that changed. ready
+// frames are already in slot. recolor frames start from front, whose colors
+// were front_cfg, or if that is null from the slot's own pixels in
+// slot_cfg's colors.
+struct Draw {
+  Target *target;
+  Slot *slot;
+  Frame frame;
+  uint64_t content;
+  bool ready;
+  bool recolor;
+  const uint32_t *front;
+  ConfigState front_cfg;
+  ConfigState slot_cfg;
+  bool captured; // composited, so target->under now describes content
+  int ndamage;   // 0 = whole buffer
+  Rect damage[16];
+};
+
+// Everything the render thread needs, copied in at submit. Until complete()
+// the main thread leaves the job's slots and underlays alone.
+struct Job {
+  uint64_t id;
+  std::string path;
+  ConfigState cfg;
+  std::vector<Draw> draws;
+  bool preload; // kept behind the screen rather than committed
+  std::atomic<bool> cancel{false};
+};
+
+// Decoding may go through libjpeg and libpng, which want more room than the
+// pixel loops of the band workers
+static constexpr size_t RENDER_STACK = 1024 * 1024;
+
+static pthread_t render_thread;
+static bool render_started = false;
+static pthread_mutex_t job_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cv = PTHREAD_COND_INITIALIZER;
+static Job *current = nullptr; // submitted and not yet completed
+static bool job_queued = false, job_done = false, render_quit = false;
+static uint64_t next_id = 1;
+static int done_fd = -1;
+
+// Frames the render thread writes to the frame cache once their job is
+// done, so the commit never waits for the disk. They are read straight
+// from the pool, which the main thread leaves in place while storing.
+struct PendingStore {
+  uint64_t key;
+  Frame frame;
+  int budget_mb;
+};
+static std::vector<PendingStore> pending_stores; // render thread only
+static bool storing = false;
+
+// Frame callbacks still owed for the last commit. The next job waits for
+// them, or for the deadline in case an output stops presenting (DPMS off,
+// surface hidden), so renders never outpace what is actually shown.
+static constexpr int PACE_TIMEOUT_MS = 100;
+static int frames_owed = 0;
+static unsigned frame_gen = 0;
+static uint64_t pace_deadline = 0;
+static uint64_t committed_us = 0;
+
+static uint64_t now_ms() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void frame_done(void *data, wl_callback *cb, uint32_t) {
+  wl_callback_destroy(cb);
+  if ((unsigned)(uintptr_t)data == frame_gen && frames_owed > 0) {
+    frames_owed--;
+    Stats::since(STAGE_PRESENT, committed_us);
+  }
+}
+
+static const wl_callback_listener frame_listener = {.done = frame_done};
+
+static void render(Job &job) {
+  WAUL_TRACE_SCOPE("render");
+  const ConfigState &cfg = job.cfg;
+  uint64_t t0 = Stats::now_us();
+  uint64_t palette_key = PaletteCache::key(job.path);
+  Palette palette;
+  bool need_palette = palette_key && !PaletteCache::find(palette_key, palette);
+  std::vector<size_t> full;
+  for (size_t i = 0; i < job.draws.size(); i++) {
+    Draw &d = job.draws[i];
+    if (d.ready)
+      continue;
+    if (!d.recolor) {
+      Stats::add(STAT_PIXELS, (int64_t)d.frame.w * d.frame.h);
+      full.push_back(i);
+      continue;
+    }
+    // The screen is damaged where front and the new frame differ; the slot
+    // is repainted where its own pixels do
+    uint64_t t = Stats::now_us();
+    const Underlay &under = d.target->under;
+    d.ndamage = recolor_damage(d.frame, d.front_cfg, cfg, under, d.damage);
+    Rect rects[16];
+    int n;
+    if (d.front) {
+      memcpy(d.frame.pixels, d.front, d.target->pool.slot_size());
+      n = d.ndamage;
+      std::copy(d.damage, d.damage + n, rects);
+    } else {
+      n = recolor_damage(d.frame, d.slot_cfg, cfg, under, rects);
+    }
+    if (n > 0)
+      recolor(d.frame, cfg, under, rects, n);
+    for (int r = 0; r < n; r++)
+      Stats::add(STAT_PIXELS, (int64_t)rects[r].w * rects[r].h);
+    Stats::since(STAGE_RECOLOR, t);
+  }
+
+  // Frames found in the cache need neither the image nor compositing
+  std::vector<Frame> misses;
+  std::vector<Underlay *> unders;
+  std::vector<uint64_t> miss_keys;
+  for (size_t i : full) {
+    Draw &d = job.draws[i];
+    uint64_t key = FrameCache::key(job.path, d.frame.w, d.frame.h, cfg);
+    uint64_t t = Stats::now_us();
+    bool hit;
+    {
+      WAUL_TRACE_SCOPE("cache_fetch");
+      hit = FrameCache::fetch(key, d.frame, d.target->pool.fd, d.slot->offset);
+    }
+    Stats::since(STAGE_CACHE_FETCH, t);
+    if (hit) {
+      Stats::add(STAT_CACHE_HITS);
+      continue;
+    }
+    if (key)
+      Stats::add(STAT_CACHE_MISSES);
+    misses.push_back(d.frame);
+    unders.push_back(&d.target->under);
+    miss_keys.push_back(key);
+    d.captured = true;
+  }
+  size_t ready = std::count_if(job.draws.begin(), job.draws.end(),
+                               [](const Draw &d) { return d.ready; });
+  log_msg(DEBUG,
+          "%s %zu frames: %zu ready, %zu recolored, %zu cached, %zu "
+          "composited",
+          job.preload ? "Preloaded" : "Drew", job.draws.size(), ready,
+          job.draws.size() - ready - full.size(), full.size() - misses.size(),
+          misses.size());
+
+  // Superseded before the expensive part; decoding itself runs to the end
+  if (!misses.empty() && !job.cancel.load(std::memory_order_relaxed)) {
+    // The decoder only needs enough resolution for the largest output,
+    // except where the image is drawn at its own size
+    bool native = cfg.fit == FIT_CENTER || cfg.fit == FIT_TILE;
+    int want_w = 0, want_h = 0;
+    for (const Frame &f : misses) {
+      want_w = native ? 0 : std::max(want_w, f.w);
+      want_h = native ? 0 : std::max(want_h, f.h);
+    }
+    Image img;
+    uint64_t t = Stats::now_us();
+    if (!job.path.empty())
+      image_load(job.path, img, want_w, want_h);
+    Stats::since(STAGE_DECODE, t);
+
+    t = Stats::now_us();
+    composite(misses.data(), misses.size(), img.pixels ? &img : nullptr, cfg,
+              unders.data(), &job.cancel);
+    Stats::since(STAGE_COMPOSITE, t);
+
+    // A failed decode renders border color only, which must not be cached,
+    // and a cancelled one is incomplete
+    bool keep = img.pixels && !job.cancel.load(std::memory_order_relaxed);
+    for (size_t i = 0; keep && cfg.frame_cache_mb > 0 && i < misses.size();
+         i++)
+      pending_stores.push_back({miss_keys[i], misses[i], cfg.frame_cache_mb});
+
+    // While the pixels are still here
+    if (need_palette && img.pixels) {
+      PaletteCache::extract(img, palette);
+      PaletteCache::store(palette_key, palette);
+      need_palette = false;
+    }
+    image_free(img);
+  }
+
+  // Every frame came from the cache, but its palette did not (evicted, or
+  // cached before palettes were): a small decode is enough
+  if (need_palette && !job.cancel.load(std::memory_order_relaxed)) {
+    Image img;
+    if (image_load(job.path, img, 256, 256)) {
+      PaletteCache::extract(img, palette);
+      PaletteCache::store(palette_key, palette);
+    }
+    image_free(img);
+  }
+
+  malloc_trim(0);
+  Stats::since(STAGE_RENDER, t0);
+}
+
+static void store_frames() {
+  uint64_t t = Stats::now_us();
+  for (const PendingStore &p : pending_stores) {
+    WAUL_TRACE_SCOPE("cache_store");
+    FrameCache::store(p.key, p.frame, p.budget_mb);
+  }
+  pending_stores.clear();
+  Stats::since(STAGE_CACHE_STORE, t);
+}
+
+static void *render_main(void *) {
+  Trace::thread_name("render");
+  pthread_mutex_lock(&job_lock);
+  while (true) {
+    while (!render_quit && !job_queued)
+      pthread_cond_wait(&job_cv, &job_lock);
+    if (render_quit)
+      break;
+    job_queued = false;
+    Job *job = current;
+    pthread_mutex_unlock(&job_lock);
+
+    render(*job);
+
+    pthread_mutex_lock(&job_lock);
+    job_done = true;
+    storing = !pending_stores.empty();
+    pthread_cond_broadcast(&job_cv);
+    uint64_t one = 1;
+    if (write(done_fd, &one, sizeof(one)) < 0) {
+    }
+    if (storing) {
+      pthread_mutex_unlock(&job_lock);
+      store_frames();
+      pthread_mutex_lock(&job_lock);
+      storing = false;
+      pthread_cond_broadcast(&job_cv);
+    }
+  }
+  pthread_mutex_unlock(&job_lock);
+  return nullptr;
+}
+
+static bool start_render_thread() {
+  if (render_started)
+    return true;
+  done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (done_fd < 0)
+    return false;
+  // Image sized buffers get their own mappings and go back on free. With
+  // the default sliding threshold glibc would keep them in the render
+  // thread's arena, whose top malloc_trim() does not release.
+  mallopt(M_MMAP_THRESHOLD, 1 << 20);
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, RENDER_STACK);
+  render_started =
+      pthread_create(&render_thread, &attr, render_main, nullptr) == 0;
+  pthread_attr_destroy(&attr);
+  if (!render_started)
+    log_msg(ERROR, "Could not start render thread");
+  return render_started;
+}
+
+int Renderer::event_fd() {
+  start_render_thread();
+  return done_fd;
+}
+
+bool Renderer::busy() {
+  if (frames_owed > 0 && now_ms() >= pace_deadline)
+    frames_owed = 0;
+  return current != nullptr || frames_owed > 0;
+}
+
+int Renderer::poll_timeout() {
+  if (current || frames_owed == 0)
+    return -1;
+  uint64_t now = now_ms();
+  return now >= pace_deadline ? 0 : (int)(pace_deadline - now);
+}
 
-  Config::load();
+void Renderer::cancel() {
+  if (current)
+    current->cancel.store(true, std::memory_order_relaxed);
+}
+
+uint64_t Renderer::submit(const std::string &path, Target *const *targets,
+                          int count, bool preload) {
+  if (busy() || !start_render_thread())
+    return 0;
+  WAUL_TRACE_SCOPE("submit");
   const auto &cfg = Config::get();
 
-  void *data =
-      mmap(nullptr, buf.size, PROT_READ | PROT_WRITE, MAP_SHARED, buf.fd, 0);
-  if (data == MAP_FAILED)
+  Job *job = new Job{next_id++, path, cfg, {}, preload};
+  for (int i = 0; i < count; i++) {
+    Target *t = targets[i];
+    BufferPool &pool = t->pool;
+    if (pool.nslots == 0)
+      continue;
+    if (!preload)
+      t->starved = false;
+
+    // Same image in the same place: only colors can differ from the screen
+    uint64_t content = content_id(path, cfg, pool.w, pool.h);
+    bool same_layout = pool.slots[pool.front].content == content;
+    if (same_layout && same_colors(pool.slots[pool.front].cfg, cfg))
+      continue;
+
+    // A preloaded or older frame is attached as it is
+    Slot *slot = find_ready(pool, content, cfg);
+    bool ready = slot != nullptr;
+    if (ready && preload) {
+      keep_preload(pool, slot);
+      continue;
+    }
+    bool can_recolor = same_layout && t->under_content == content;
+    if (!slot && !preload && can_recolor)
+      slot = find_recolorable(pool, content);
+    // Acquiring may grow and so move the mapping; take pointers after
+    if (!slot)
+      slot = preload ? acquire_spare(shm_ref, pool)
+                     : acquire_slot(shm_ref, pool);
+    if (!slot) {
+      t->starved = !preload;
+      continue;
+    }
+    const Slot &front = pool.slots[pool.front];
+    Draw d = {};
+    d.target = t;
+    d.slot = slot;
+    d.frame = Frame{pool.pixels(*slot), pool.w, pool.h, pool.w};
+    d.content = content;
+    d.ready = ready;
+    d.front_cfg = front.cfg;
+    d.slot_cfg = slot->cfg;
+    if (!ready && can_recolor) {
+      d.recolor = true;
+      if (slot->content != content)
+        d.front = pool.pixels(front);
+    }
+    job->draws.push_back(d);
+  }
+  if (job->draws.empty()) {
+    delete job;
+    return 0;
+  }
+
+  Stats::add(STAT_JOBS);
+  pthread_mutex_lock(&job_lock);
+  current = job;
+  job_queued = true;
+  job_done = false;
+  pthread_cond_broadcast(&job_cv);
+  pthread_mutex_unlock(&job_lock);
+  return job->id;
+}
+
+// Blocks until the render thread is done with current
+static void wait_done() {
+  pthread_mutex_lock(&job_lock);
+  while (current && !job_done)
+    pthread_cond_wait(&job_cv, &job_lock);
+  pthread_mutex_unlock(&job_lock);
+}
+
+// Blocks until the frames of the last job are in the cache; for anything
+// that moves or frees pool memory
+static void wait_stored() {
+  pthread_mutex_lock(&job_lock);
+  while (storing)
+    pthread_cond_wait(&job_cv, &job_lock);
+  pthread_mutex_unlock(&job_lock);
+}
+
+void Renderer::detach(Target *t) {
+  if (!current)
     return;
+  wait_done();
+  auto &draws = current->draws;
+  draws.erase(std::remove_if(draws.begin(), draws.end(),
+                             [t](const Draw &d) { return d.target == t; }),
+              draws.end());
+}
 
-  uint32_t *pixels = (uint32_t *)data;
-  uint32_t bg_color =
-      (0xFF << 24) | (cfg.bg[0] << 16) | (cfg.bg[1] << 8) | cfg.bg[2];
-
-  uint32_t border_color =
-      (0xFF << 24) | (cfg.bc[0] << 16) | (cfg.bc[1] << 8) | cfg.bc[2];
-  if (cfg.bc[3] < 255)
-    border_color =
-        mix_alpha(cfg.bc[0], cfg.bc[1], cfg.bc[2], cfg.bc[3], bg_color);
-
-  int cx = cfg.m[1];
-  int cy = cfg.m[0];
-  int cw = buf.w - cfg.m[1] - cfg.m[3];
-  int ch = buf.h - cfg.m[0] - cfg.m[2];
-
-  int iw = 0, ih = 0, ic = 0;
-  uint8_t *img = nullptr;
-  if (!path.empty()) {
-    img = stbi_load(path.c_str(), &iw, &ih, &ic, 4);
-  }
-
-  float scale = 0;
-  int ox = 0, oy = 0;
-
-  if (img) {
-    int inner_w = cw - cfg.bw[1] - cfg.bw[3];
-    int inner_h = ch - cfg.bw[0] - cfg.bw[2];
-    scale = std::max((float)inner_w / iw, (float)inner_h / ih);
-    int sw = iw * scale;
-    int sh = ih * scale;
-    ox = cx + cfg.bw[1] + (inner_w - sw) / 2;
-    oy = cy + cfg.bw[0] + (inner_h - sh) / 2;
-  }
-
-  for (int y = 0; y < buf.h; y++) {
-    for (int x = 0; x < buf.w; x++) {
-      bool is_margin = (x < cx || x >= cx + cw || y < cy || y >= cy + ch);
-      uint32_t final_pixel = bg_color;
-
-      if (!is_margin) {
-        int rx = x - cx, ry = y - cy;
-        int rad = 0;
-        float dist = 0;
-
-        // Corner Check
-        if (rx < cfg.br[0] && ry < cfg.br[0]) {
-          rad = cfg.br[0];
-          dist = sqrt(pow(cfg.br[0] - rx - 0.5f, 2) +
-                      pow(cfg.br[0] - ry - 0.5f, 2));
-        } else if (rx >= cw - cfg.br[1] && ry < cfg.br[1]) {
-          rad = cfg.br[1];
-          dist = sqrt(pow(rx - (cw - cfg.br[1]) + 0.5f, 2) +
-                      pow(cfg.br[1] - ry - 0.5f, 2));
-        } else if (rx >= cw - cfg.br[2] && ry >= ch - cfg.br[2]) {
-          rad = cfg.br[2];
-          dist = sqrt(pow(rx - (cw - cfg.br[2]) + 0.5f, 2) +
-                      pow(ry - (ch - cfg.br[2]) + 0.5f, 2));
-        } else if (rx < cfg.br[3] && ry >= ch - cfg.br[3]) {
-          rad = cfg.br[3];
-          dist = sqrt(pow(cfg.br[3] - rx - 0.5f, 2) +
-                      pow(ry - (ch - cfg.br[3]) + 0.5f, 2));
-        }
-
-        uint32_t content_pixel = bg_color;
-
-        // Determine content pixel
-        bool is_border = (y < cy + cfg.bw[0] || y >= cy + ch - cfg.bw[2] ||
-                          x < cx + cfg.bw[1] || x >= cx + cw - cfg.bw[3]);
-
-        if (is_border) {
-          content_pixel = border_color;
-        } else if (img) {
-          int sx = (x - ox) / scale;
-          int sy = (y - oy) / scale;
-          if (sx >= 0 && sy >= 0 && sx < iw && sy < ih) {
-            int i = (sy * iw + sx) * 4;
-            content_pixel =
-                (0xFF << 24) | (img[i] << 16) | (img[i + 1] << 8) | img[i + 2];
-          } else {
-            content_pixel = border_color; // Fallback if scaling leaves gaps
-          }
-        } else {
-          content_pixel = border_color;
-        }
-
-        if (rad > 0) {
-          // Pick border width for this corner
-          int bw = 0;
-          if (rx < cfg.br[0] && ry < cfg.br[0])
-            bw = std::max(cfg.bw[0], cfg.bw[1]); // TL
-          else if (rx >= cw - cfg.br[1] && ry < cfg.br[1])
-            bw = std::max(cfg.bw[0], cfg.bw[3]); // TR
-          else if (rx >= cw - cfg.br[2] && ry >= ch - cfg.br[2])
-            bw = std::max(cfg.bw[2], cfg.bw[3]); // BR
-          else if (rx < cfg.br[3] && ry >= ch - cfg.br[3])
-            bw = std::max(cfg.bw[2], cfg.bw[1]); // BL
-
-          int outer_rad = rad;
-          int inner_rad = std::max(0, outer_rad - bw);
-          float dx = 0.0f, dy = 0.0f;
-
-          if (rx < rad && ry < rad) { // TL
-            dx = std::max(0.0f, float(rad - rx - 0.5f));
-            dy = std::max(0.0f, float(rad - ry - 0.5f));
-          } else if (rx >= cw - rad && ry < rad) { // TR
-            dx = std::max(0.0f, float(rx - (cw - rad) + 0.5f));
-            dy = std::max(0.0f, float(rad - ry - 0.5f));
-          } else if (rx >= cw - rad && ry >= ch - rad) { // BR
-            dx = std::max(0.0f, float(rx - (cw - rad) + 0.5f));
-            dy = std::max(0.0f, float(ry - (ch - rad) + 0.5f));
-          } else if (rx < rad && ry >= ch - rad) { // BL
-            dx = std::max(0.0f, float(rad - rx - 0.5f));
-            dy = std::max(0.0f, float(ry - (ch - rad) + 0.5f));
-          }
-
-          float dist = sqrt(dx * dx + dy * dy) - 0.5f;
-
-          if (dist > outer_rad) {
-            final_pixel = bg_color;
-          } else if (dist > outer_rad - 1.0f) {
-            float t = dist - (outer_rad - 1.0f);
-            final_pixel = blend(border_color, bg_color, t);
-          } else if (dist > inner_rad) {
-            final_pixel = border_color;
-          } else if (dist > inner_rad - 1.0f) {
-            float t = dist - (inner_rad - 1.0f);
-            final_pixel = blend(content_pixel, border_color, t);
-          } else {
-            final_pixel = content_pixel;
-          }
-        } else {
-          final_pixel = content_pixel;
-        }
-      }
-      pixels[y * buf.w + x] = final_pixel;
-    }
-  }
-
-  if (img)
-    stbi_image_free(img);
+uint64_t Renderer::complete(bool *cancelled) {
+  uint64_t n;
+  if (read(done_fd, &n, sizeof(n)) < 0) {
+  }
+  pthread_mutex_lock(&job_lock);
+  bool done = current && job_done;
+  pthread_mutex_unlock(&job_lock);
+  if (!done)
+    return 0;
+
+  uint64_t id = current->id;
+  bool dropped = current->cancel.load(std::memory_order_relaxed);
+  if (cancelled)
+    *cancelled = dropped;
+  if (dropped) {
+    Stats::add(STAT_CANCELLED);
+    // Partly drawn: neither the slots nor the underlays hold anything known
+    for (Draw &d : current->draws) {
+      if (d.ready)
+        continue;
+      d.slot->content = 0;
+      d.slot->preloaded = false;
+      if (d.captured)
+        d.target->under_content = 0;
+    }
+    delete current;
+    current = nullptr;
+    return id;
+  }
 
-  malloc_trim(0);
+  const ConfigState &cfg = current->cfg;
+  if (current->preload) {
+    for (Draw &d : current->draws) {
+      d.slot->content = d.content;
+      d.slot->cfg = cfg;
+      if (d.captured)
+        d.target->under_content = d.content;
+      keep_preload(d.target->pool, d.slot);
+    }
+    delete current;
+    current = nullptr;
+    return id;
+  }
 
-  munmap(data, buf.size);
+  frame_gen++;
+  frames_owed = 0;
+  pace_deadline = now_ms() + PACE_TIMEOUT_MS;
+  committed_us = Stats::now_us();
+  for (Draw &d : current->draws) {
+    BufferPool &pool = d.target->pool;
+    pool.front = d.slot - pool.slots;
+    d.slot->busy = true;
+    d.slot->preloaded = false;
+    d.slot->content = d.content;
+    d.slot->cfg = cfg;
+    if (d.captured)
+      d.target->under_content = d.content;
+
+    wl_surface *surf = d.target->surf;
+    wl_surface_attach(surf, d.slot->wlbuf, 0, 0);
+    if (d.ndamage == 0)
+      wl_surface_damage_buffer(surf, 0, 0, d.frame.w, d.frame.h);
+    for (int r = 0; r < d.ndamage; r++)
+      wl_surface_damage_buffer(surf, d.damage[r].x, d.damage[r].y,
+                               d.damage[r].w, d.damage[r].h);
+    wl_callback *cb = wl_surface_frame(surf);
+    wl_callback_add_listener(cb, &frame_listener, (void *)(uintptr_t)frame_gen);
+    frames_owed++;
+    WAUL_TRACE_SCOPE("wl_surface_commit");
+    wl_surface_commit(surf);
+    Stats::add(STAT_FRAMES);
+  }
+
+  delete current;
+  current = nullptr;
+  return id;
+}
 
-  wl_surface_attach(surf, buf.wlbuf, 0, 0);
-  wl_surface_damage(surf, 0, 0, buf.w, buf.h);
-  wl_surface_commit(surf);
+size_t Renderer::drop_preloads(Target *const *targets, int count) {
+  wait_stored();
+  size_t freed = 0;
+  for (int i = 0; i < count; i++) {
+    BufferPool &pool = targets[i]->pool;
+    for (int j = 0; j < pool.nslots; j++) {
+      Slot &s = pool.slots[j];
+      if (!s.preloaded || s.busy)
+        continue;
+      // The pool cannot shrink, but its pages can go back to the kernel
+      if (fallocate(pool.fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    s.offset, pool.slot_size()) == 0)
+        freed += pool.slot_size();
+      s.preloaded = false;
+      s.content = 0;
+    }
+  }
+  return freed;
+}
+
+void Renderer::shutdown() {
+  if (!render_started)
+    return;
+  wait_done();
+  delete current;
+  current = nullptr;
+  pthread_mutex_lock(&job_lock);
+  render_quit = true;
+  pthread_cond_broadcast(&job_cv);
+  pthread_mutex_unlock(&job_lock);
+  pthread_join(render_thread, nullptr);
+  render_started = false;
+  close(done_fd);
+  done_fd = -1;
 }
 
-} // namespace waul
\ No newline at end of file
+} // namespace waul
@@ -1,27 +1,98 @@
 #pragma once
+#include "compositor.hpp"
+#include "config.hpp"
+#include <cstdint>
 #include <string>
 #include <wayland-client.h>
 
 namespace waul {
 
-struct Buffer {
+// One wl_buffer carved out of a BufferPool. busy while the compositor may
+// still read it, i.e. from attach until the release event. content and cfg
+// describe the pixels it holds, content being 0 until it is first drawn.
+// preloaded frames wait behind the screen for a later set.
+struct Slot {
   wl_buffer *wlbuf = nullptr;
+  size_t offset = 0;
+  bool busy = false;
+  bool preloaded = false;
+  uint64_t content = 0;
+  ConfigState cfg;
+};
+
+// Per-output shm pool, mapped once for its whole lifetime. Draws go to a
+// free slot so the buffer on screen is never written to.
+struct BufferPool {
+  static constexpr int DEFAULT_SLOTS = 2;
+  static constexpr int MAX_SLOTS = 3;
+
   int fd = -1;
-  int w = 0, h = 0;
+  wl_shm_pool *pool = nullptr;
+  uint8_t *data = nullptr;
   size_t size = 0;
+  int w = 0, h = 0;
+  int nslots = 0;
+  int front = 0; // slot attached last
+  Slot slots[MAX_SLOTS];
+
+  size_t slot_size() const { return (size_t)w * h * 4; }
+  uint32_t *pixels(const Slot &s) const {
+    return (uint32_t *)(data + s.offset);
+  }
+};
+
+// A surface on one output together with the buffers it shows. under is
+// captured by the last full composite, for content under_content.
+struct Target {
+  wl_surface *surf = nullptr;
+  BufferPool pool;
+  Underlay under;
+  uint64_t under_content = 0;
+  // Left out of a job because the compositor held every buffer; drawn
+  // again once has_free_slot()
+  bool starved = false;
 };
 
 class Renderer {
 public:
   static void init(wl_shm *shm);
-  static void resize_buffer(int w, int h);
-  static void draw(const std::string &image_path, wl_surface *surf);
-  static void cleanup();
-  static const Buffer &get_buffer() { return buf; }
+  static void resize_pool(BufferPool &pool, int w, int h);
+  static void destroy_pool(BufferPool &pool);
+  // Whether a job could draw into pool without waiting for a release
+  static bool has_free_slot(const BufferPool &pool);
+
+  // Picks a buffer in every target that needs redrawing and hands the job
+  // to the render thread, which decodes image_path once and composites it
+  // into all of them in parallel. Targets whose image and layout are
+  // unchanged are only recolored, and frames already sitting in a back
+  // buffer are attached as they are. A preload job renders into a spare
+  // buffer and commits nothing. Returns the job id, or 0 if no target
+  // needed a new frame or the renderer is busy.
+  static uint64_t submit(const std::string &image_path,
+                         Target *const *targets, int count,
+                         bool preload = false);
+  // A job is running, or the last commit has not been presented yet
+  static bool busy();
+  // Milliseconds until busy() clears on its own, -1 if only an event can
+  static int poll_timeout();
+  // Stops the running job at the next row band; it completes cancelled
+  static void cancel();
+
+  // Becomes readable when the running job has finished rendering
+  static int event_fd();
+  // Attaches and commits the finished frames, damaging only what changed.
+  // A cancelled job commits nothing. Returns the job id, or 0 if nothing
+  // has finished.
+  static uint64_t complete(bool *cancelled = nullptr);
+  // Waits out the running job and drops t from it; for targets about to
+  // lose their buffers
+  static void detach(Target *t);
+  // Forgets preloaded frames and returns their memory; bytes freed
+  static size_t drop_preloads(Target *const *targets, int count);
+  static void shutdown();
 
 private:
-  static Buffer buf;
   static wl_shm *shm_ref;
 };
 
-} // namespace waul
\ No newline at end of file
+} // namespace waul
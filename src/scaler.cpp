@@ -0,0 +1,173 @@
+#include "scaler.hpp"
+#include "pixel_ops.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace waul {
+
+void Scaler::setup(const Image &src, Filter filter, int ox_, int oy_, int sw_,
+                   int sh_, int x0, int x1) {
+  img = &src;
+  ox = ox_;
+  oy = oy_;
+  sw = std::max(sw_, 1);
+  sh = std::max(sh_, 1);
+
+  uint32_t step_x = ((uint64_t)img->w << 16) / sw;
+  step_y = ((uint64_t)img->h << 16) / sh;
+
+  // Box filtering only pays off when shrinking by 2x or more
+  mode = filter;
+  if (mode == FILTER_AREA && step_x < (2u << 16) && step_y < (2u << 16))
+    mode = FILTER_BILINEAR;
+
+  uniform = mode == FILTER_AREA && img->w % sw == 0 && img->h % sh == 0 &&
+            img->h / sh <= 256;
+  if (uniform)
+    box_recip = (1u << 24) / ((img->w / sw) * (img->h / sh));
+
+  vx0 = std::clamp(ox, x0, x1);
+  vx1 = std::clamp(ox + sw, vx0, x1);
+  int n = vx1 - vx0;
+  col_a.resize(n);
+  col_b.resize(n);
+  col_f.resize(n);
+
+  int last = img->w - 1;
+  uint64_t pos = (uint64_t)(vx0 - ox) * step_x;
+  for (int i = 0; i < n; i++, pos += step_x) {
+    if (mode == FILTER_NEAREST) {
+      col_a[i] = std::min<int64_t>(last, (pos + step_x / 2) >> 16);
+    } else if (mode == FILTER_BILINEAR) {
+      int64_t c = std::max<int64_t>(0, pos + step_x / 2 - 0x8000);
+      int a = c >> 16;
+      if (a >= last) {
+        col_a[i] = col_b[i] = last;
+        col_f[i] = 0;
+      } else {
+        col_a[i] = a;
+        col_b[i] = a + 1;
+        col_f[i] = (c >> 8) & 0xFF;
+      }
+    } else {
+      int a = std::min<int64_t>(last, pos >> 16);
+      int b = std::min<int64_t>(img->w, (pos + step_x) >> 16);
+      col_a[i] = a;
+      col_b[i] = std::max(b, a + 1);
+    }
+  }
+}
+
+void Scaler::row(int y, uint32_t *dst, ScalerScratch &scratch) const {
+  if (vx0 >= vx1)
+    return;
+  if (mode == FILTER_NEAREST)
+    row_nearest(y, dst);
+  else if (mode == FILTER_BILINEAR)
+    row_bilinear(y, dst, scratch);
+  else if (uniform)
+    row_area<true>(y, dst, scratch);
+  else
+    row_area<false>(y, dst, scratch);
+}
+
+void Scaler::row_nearest(int y, uint32_t *dst) const {
+  uint64_t py = (uint64_t)(y - oy) * step_y;
+  int sy = std::min<int64_t>(img->h - 1, (py + step_y / 2) >> 16);
+  const uint32_t *srow = img->pixels + (size_t)sy * img->w;
+
+  uint32_t *out = dst + vx0;
+  for (int i = 0, n = vx1 - vx0; i < n; i++)
+    out[i] = srow[col_a[i]];
+}
+
+// Source row sy interpolated horizontally. Rows are cached by parity, so
+// destination rows sharing source rows (upscaling) interpolate them once.
+const uint32_t *Scaler::hrow(int sy, ScalerScratch &scratch) const {
+  int n = vx1 - vx0, slot = sy & 1;
+  uint32_t *out = scratch.buf.data() + (size_t)slot * n;
+  if (scratch.tag[slot] != sy) {
+    const uint32_t *srow = img->pixels + (size_t)sy * img->w;
+    for (int i = 0; i < n; i++)
+      out[i] = blend_px(srow[col_a[i]], srow[col_b[i]], col_f[i]);
+    scratch.tag[slot] = sy;
+  }
+  return out;
+}
+
+void Scaler::row_bilinear(int y, uint32_t *dst, ScalerScratch &scratch) const {
+  uint64_t py = (uint64_t)(y - oy) * step_y;
+  int64_t c = std::max<int64_t>(0, py + step_y / 2 - 0x8000);
+  int sy = c >> 16, fy = (c >> 8) & 0xFF;
+  if (sy >= img->h - 1) {
+    sy = img->h - 1;
+    fy = 0;
+  }
+
+  int n = vx1 - vx0;
+  if (scratch.buf.size() < (size_t)2 * n) {
+    scratch.buf.resize((size_t)2 * n);
+    scratch.tag[0] = scratch.tag[1] = -1;
+  }
+
+  uint32_t *out = dst + vx0;
+  const uint32_t *top = hrow(sy, scratch);
+  if (!fy) {
+    memcpy(out, top, n * 4);
+    return;
+  }
+  const uint32_t *bot = hrow(sy + 1, scratch);
+  for (int i = 0; i < n; i++)
+    out[i] = blend_px(top[i], bot[i], fy);
+}
+
+template <bool Uniform>
+void Scaler::row_area(int y, uint32_t *dst, ScalerScratch &scratch) const {
+  uint64_t py = (uint64_t)(y - oy) * step_y;
+  int sy0 = std::min<int64_t>(img->h - 1, py >> 16);
+  int sy1 = std::min<int64_t>(img->h, (py + step_y) >> 16);
+  // Packed red/blue sums hold 256 rows without carrying into each other
+  sy1 = std::clamp(sy1, sy0 + 1, sy0 + 256);
+
+  int n = vx1 - vx0;
+  int sx0 = col_a[0], sx1 = col_b[n - 1], span = sx1 - sx0;
+  if (scratch.buf.size() < (size_t)2 * span)
+    scratch.buf.resize((size_t)2 * span);
+  uint32_t *v_rb = scratch.buf.data(), *v_g = v_rb + span;
+
+  // Separable box: sum the covered source rows per column first...
+  const uint32_t *srow = img->pixels + (size_t)sy0 * img->w + sx0;
+  for (int i = 0; i < span; i++) {
+    v_rb[i] = srow[i] & 0xFF00FF;
+    v_g[i] = (srow[i] >> 8) & 0xFF;
+  }
+  for (int sy = sy0 + 1; sy < sy1; sy++) {
+    srow += img->w;
+    for (int i = 0; i < span; i++) {
+      uint32_t p = srow[i];
+      v_rb[i] += p & 0xFF00FF;
+      v_g[i] += (p >> 8) & 0xFF;
+    }
+  }
+
+  // ...then each destination column's box of those sums
+  uint32_t *out = dst + vx0;
+  uint32_t rows = sy1 - sy0;
+  for (int i = 0; i < n; i++) {
+    uint32_t r = 0, g = 0, b = 0;
+    for (int sx = col_a[i] - sx0, e = col_b[i] - sx0; sx < e; sx++) {
+      r += v_rb[sx] >> 16;
+      b += v_rb[sx] & 0xFFFF;
+      g += v_g[sx];
+    }
+    uint64_t recip = Uniform ? box_recip
+                             : (1u << 24) / ((col_b[i] - col_a[i]) * rows);
+    r = std::min<uint64_t>(255, (r * recip + (1u << 23)) >> 24);
+    g = std::min<uint64_t>(255, (g * recip + (1u << 23)) >> 24);
+    b = std::min<uint64_t>(255, (b * recip + (1u << 23)) >> 24);
+    out[i] = 0xFF000000 | (r << 16) | (g << 8) | b;
+  }
+}
+
+} // namespace waul
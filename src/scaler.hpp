@@ -0,0 +1,50 @@
+#pragma once
+#include "compositor.hpp"
+#include "config.hpp"
+#include <cstdint>
+#include <vector>
+
+namespace waul {
+
+// Per-thread working memory for Scaler::row.
+struct ScalerScratch {
+  std::vector<uint32_t> buf;
+  int tag[2] = {-1, -1}; // Source rows held in the bilinear row cache
+};
+
+// Maps an image scaled to sw x sh and placed at (ox, oy) onto destination
+// pixels. Column tables are built once per draw in 16.16 fixed point, rows
+// are resolved on the fly, so row() is const and safe to call concurrently.
+class Scaler {
+public:
+  void setup(const Image &img, Filter filter, int ox, int oy, int sw, int sh,
+             int x0, int x1);
+
+  // Writes the destination columns the scaled image covers, clipped to
+  // [x0, x1), for destination row y.
+  void row(int y, uint32_t *dst, ScalerScratch &scratch) const;
+
+private:
+  void row_nearest(int y, uint32_t *dst) const;
+  void row_bilinear(int y, uint32_t *dst, ScalerScratch &scratch) const;
+  template <bool Uniform>
+  void row_area(int y, uint32_t *dst, ScalerScratch &scratch) const;
+  const uint32_t *hrow(int sy, ScalerScratch &scratch) const;
+
+  const Image *img = nullptr;
+  Filter mode = FILTER_NEAREST;
+  int ox = 0, oy = 0, sw = 0, sh = 0;
+  int vx0 = 0, vx1 = 0;
+  uint32_t step_y = 0;
+  // Area boxes all the same size (an integer shrink): one reciprocal serves
+  // every pixel
+  bool uniform = false;
+  uint32_t box_recip = 0;
+
+  // Per destination column: first source column, then the second bilinear
+  // tap or the end of the area box, and the bilinear weight (0-255).
+  std::vector<int> col_a, col_b;
+  std::vector<uint8_t> col_f;
+};
+
+} // namespace waul
@@ -0,0 +1,242 @@
+#include "slideshow.hpp"
+#include "common.hpp"
+#include "wayland_backend.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <random>
+#include <strings.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+#include <vector>
+
+namespace waul {
+
+// The next image is preloaded this long before its switch, or half the
+// interval if that is shorter
+static constexpr int PREFETCH_LEAD_MS = 15000;
+
+static std::string source;
+static int interval_ms = 0;
+static bool shuffle = false;
+static bool configured = false;
+
+static std::vector<std::string> playlist; // in play order
+static size_t pos = 0;                    // shown, once started
+static bool started = false;
+static bool paused = false;
+static bool prefetched = false;
+static uint64_t next_at = 0; // monotonic ms of the next switch
+static uint64_t paused_left = 0;
+static int tfd = -1;
+static std::minstd_rand rng;
+
+static uint64_t now_ms() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static bool is_image(const char *name) {
+  static const char *const exts[] = {"jpg", "jpeg", "png", "bmp", "gif",
+                                     "tga", "psd",  "hdr", "pic", "pnm",
+                                     "ppm", "pgm"};
+  const char *dot = strrchr(name, '.');
+  if (!dot)
+    return false;
+  for (const char *e : exts) {
+    if (strcasecmp(dot + 1, e) == 0)
+      return true;
+  }
+  return false;
+}
+
+static void scan_dir(const std::string &dir, std::vector<std::string> &out) {
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return;
+  while (dirent *e = readdir(d)) {
+    if (e->d_name[0] == '.' || !is_image(e->d_name))
+      continue;
+    std::string p = dir + "/" + e->d_name;
+    struct stat st;
+    if (stat(p.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+      out.push_back(p);
+  }
+  closedir(d);
+  std::sort(out.begin(), out.end());
+}
+
+// One path per line; # comments, relative paths are taken from the list's
+// directory
+static void read_list(const std::string &file, std::vector<std::string> &out) {
+  FILE *f = fopen(file.c_str(), "r");
+  if (!f)
+    return;
+  std::string dir = file.substr(0, file.rfind('/') + 1);
+  char line[1024];
+  while (fgets(line, sizeof(line), f)) {
+    char *s = line;
+    while (*s == ' ' || *s == '\t')
+      s++;
+    char *end = s + strlen(s);
+    while (end > s && strchr(" \t\r\n", end[-1]))
+      *--end = 0;
+    if (*s == 0 || *s == '#')
+      continue;
+    out.push_back(*s == '/' ? std::string(s) : dir + s);
+  }
+  fclose(f);
+}
+
+static int lead_ms() { return std::min(PREFETCH_LEAD_MS, interval_ms / 2); }
+
+static size_t upcoming() { return started ? (pos + 1) % playlist.size() : 0; }
+
+static void arm() {
+  itimerspec its = {};
+  if (!paused && playlist.size() > 1) {
+    uint64_t at = prefetched ? next_at : next_at - lead_ms();
+    uint64_t now = now_ms();
+    uint64_t wait = at > now ? at - now : 1;
+    its.it_value.tv_sec = wait / 1000;
+    its.it_value.tv_nsec = (wait % 1000) * 1000000;
+  }
+  timerfd_settime(tfd, 0, &its, nullptr);
+}
+
+// Shows the next image that still exists and starts a new interval
+static void advance() {
+  for (size_t tries = 0; tries < playlist.size(); tries++) {
+    pos = upcoming();
+    started = true;
+    // Reshuffled on the last image, which moves to the back so the new
+    // round never starts with what is on screen
+    if (shuffle && pos == playlist.size() - 1 && playlist.size() > 2)
+      std::shuffle(playlist.begin(), playlist.end() - 1, rng);
+    if (access(playlist[pos].c_str(), R_OK) == 0) {
+      Wayland::set_wallpaper(playlist[pos]);
+      break;
+    }
+    log_msg(WARN, "Slideshow image missing: %s", playlist[pos].c_str());
+  }
+  next_at = now_ms() + interval_ms;
+  paused_left = interval_ms;
+  prefetched = false;
+  arm();
+}
+
+void Slideshow::configure(const ConfigState &cfg) {
+  int interval = std::max(cfg.slideshow_interval, 1) * 1000;
+  if (configured && cfg.slideshow == source && interval == interval_ms &&
+      cfg.slideshow_shuffle == shuffle)
+    return;
+  configured = true;
+  source = cfg.slideshow;
+  interval_ms = interval;
+  shuffle = cfg.slideshow_shuffle;
+
+  playlist.clear();
+  started = paused = prefetched = false;
+  if (source.empty()) {
+    if (tfd >= 0)
+      arm();
+    return;
+  }
+
+  struct stat st;
+  if (stat(source.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+    scan_dir(source, playlist);
+  else
+    read_list(source, playlist);
+  if (playlist.empty()) {
+    log_msg(WARN, "Slideshow: no images in %s", source.c_str());
+    if (tfd >= 0)
+      arm();
+    return;
+  }
+
+  if (tfd < 0)
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  if (shuffle) {
+    rng.seed(now_ms() ^ getpid());
+    std::shuffle(playlist.begin(), playlist.end(), rng);
+  }
+  log_msg(INFO, "Slideshow: %zu images from %s, every %ds%s",
+          playlist.size(), source.c_str(), interval_ms / 1000,
+          shuffle ? ", shuffled" : "");
+
+  // Carry on from the wallpaper on screen if it is part of the playlist
+  auto it = std::find(playlist.begin(), playlist.end(),
+                      Wayland::get_current_wallpaper());
+  if (it == playlist.end()) {
+    advance();
+    return;
+  }
+  pos = it - playlist.begin();
+  started = true;
+  next_at = now_ms() + interval_ms;
+  arm();
+}
+
+int Slideshow::timer_fd() { return tfd; }
+
+void Slideshow::tick() {
+  uint64_t expirations;
+  if (read(tfd, &expirations, sizeof(expirations)) < 0 || paused ||
+      playlist.size() < 2)
+    return;
+  uint64_t now = now_ms();
+  if (now >= next_at) {
+    advance();
+    return;
+  }
+  if (!prefetched && now + lead_ms() >= next_at) {
+    prefetched = true;
+    Wayland::preload(playlist[upcoming()]);
+  }
+  arm();
+}
+
+void Slideshow::pause() {
+  if (paused || playlist.empty())
+    return;
+  paused = true;
+  uint64_t now = now_ms();
+  paused_left = next_at > now ? next_at - now : 0;
+  arm();
+  log_msg(INFO, "Slideshow paused");
+}
+
+void Slideshow::resume() {
+  if (!paused)
+    return;
+  paused = false;
+  next_at = now_ms() + paused_left;
+  arm();
+  log_msg(INFO, "Slideshow resumed");
+}
+
+void Slideshow::next() {
+  if (playlist.size() > 1)
+    advance();
+}
+
+std::string Slideshow::status() {
+  if (playlist.empty())
+    return "off";
+  uint64_t now = now_ms();
+  uint64_t left = paused ? paused_left : next_at > now ? next_at - now : 0;
+  char buf[1200];
+  snprintf(buf, sizeof(buf), "%s %zu/%zu %s next in %llus",
+           paused ? "paused" : "playing", started ? pos + 1 : 0,
+           playlist.size(), started ? playlist[pos].c_str() : "-",
+           (unsigned long long)(left / 1000));
+  return buf;
+}
+
+} // namespace waul
@@ -0,0 +1,29 @@
+#pragma once
+#include "config.hpp"
+#include <string>
+
+namespace waul {
+
+// Daemon side wallpaper rotation over the images of a directory or the
+// paths of a list file, one per line. Driven by a timerfd in the main loop,
+// which first fires a little before each switch to preload the next image,
+// so the switch itself only swaps buffers.
+class Slideshow {
+public:
+  // Picks up the slideshow keys of cfg. The playlist is only rebuilt, and
+  // the timer restarted, when they changed.
+  static void configure(const ConfigState &cfg);
+  // -1 while no slideshow is configured
+  static int timer_fd();
+  // Handles an expiry of timer_fd()
+  static void tick();
+
+  static void pause();
+  static void resume();
+  // Switches to the next image now and restarts the interval
+  static void next();
+  // "playing 3/41 /path/to/image.jpg next in 212s", or "off"
+  static std::string status();
+};
+
+} // namespace waul
@@ -0,0 +1,210 @@
+#include "stats.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <malloc.h>
+#include <time.h>
+
+namespace waul {
+
+// Bucket b counts durations in [2^(b-1), 2^b) us, bucket 0 those under 1us
+static constexpr int BUCKETS = 32;
+
+struct Histogram {
+  std::atomic<uint64_t> count{0}, sum{0}, max{0};
+  std::atomic<uint64_t> buckets[BUCKETS] = {};
+};
+
+static Histogram stages[STAGE_COUNT];
+static std::atomic<int64_t> counters[STAT_COUNT];
+static const uint64_t started_us = Stats::now_us();
+
+static const char *const stage_names[STAGE_COUNT] = {
+    "set",       "configure", "present",     "render",     "decode",
+    "composite", "recolor",   "cache_fetch", "cache_store"};
+static const char *const counter_names[STAT_COUNT] = {
+    "sets",       "superseded",   "jobs",   "cancelled", "frames",
+    "cache_hits", "cache_misses", "pixels", "buffers",   "shm_bytes"};
+
+uint64_t Stats::now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Stats::record(Stage s, uint64_t us) {
+  Histogram &h = stages[s];
+  int b = us ? 64 - __builtin_clzll(us) : 0;
+  h.buckets[b < BUCKETS ? b : BUCKETS - 1].fetch_add(
+      1, std::memory_order_relaxed);
+  h.count.fetch_add(1, std::memory_order_relaxed);
+  h.sum.fetch_add(us, std::memory_order_relaxed);
+  uint64_t m = h.max.load(std::memory_order_relaxed);
+  while (us > m && !h.max.compare_exchange_weak(m, us,
+                                                std::memory_order_relaxed)) {
+  }
+}
+
+void Stats::add(Counter c, int64_t n) {
+  counters[c].fetch_add(n, std::memory_order_relaxed);
+}
+
+// A copy taken at once, so the figures of one stage agree with each other
+struct Snapshot {
+  uint64_t count, sum, max;
+  uint64_t buckets[BUCKETS];
+};
+
+static Snapshot snapshot(const Histogram &h) {
+  Snapshot s;
+  for (int b = 0; b < BUCKETS; b++)
+    s.buckets[b] = h.buckets[b].load(std::memory_order_relaxed);
+  s.count = h.count.load(std::memory_order_relaxed);
+  s.sum = h.sum.load(std::memory_order_relaxed);
+  s.max = h.max.load(std::memory_order_relaxed);
+  return s;
+}
+
+// Upper bound of the bucket holding quantile q, capped by the maximum
+static uint64_t quantile(const Snapshot &s, double q) {
+  uint64_t total = 0;
+  for (int b = 0; b < BUCKETS; b++)
+    total += s.buckets[b];
+  uint64_t rank = (uint64_t)(q * total), seen = 0;
+  for (int b = 0; b < BUCKETS; b++) {
+    seen += s.buckets[b];
+    if (seen > rank)
+      return b ? std::min<uint64_t>(1ull << b, s.max) : 0;
+  }
+  return s.max;
+}
+
+struct Memory {
+  uint64_t rss = 0, peak_rss = 0; // bytes
+  uint64_t heap = 0, heap_mmap = 0;
+};
+
+static Memory memory() {
+  Memory m;
+  FILE *f = fopen("/proc/self/status", "r");
+  if (f) {
+    char line[128];
+    unsigned long long kb;
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "VmRSS: %llu kB", &kb) == 1)
+        m.rss = kb << 10;
+      else if (sscanf(line, "VmHWM: %llu kB", &kb) == 1)
+        m.peak_rss = kb << 10;
+    }
+    fclose(f);
+  }
+  // glibc reports the main arena only; thread arenas still count in rss
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  struct mallinfo2 mi = mallinfo2();
+  m.heap = mi.uordblks;
+  m.heap_mmap = mi.hblkhd;
+#endif
+  return m;
+}
+
+static void append(std::string &out, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void append(std::string &out, const char *fmt, ...) {
+  char buf[256];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  out.append(buf, std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+static std::string duration(uint64_t us) {
+  char buf[32];
+  if (us < 1000)
+    snprintf(buf, sizeof(buf), "%lluus", (unsigned long long)us);
+  else if (us < 1000000)
+    snprintf(buf, sizeof(buf), "%.1fms", us / 1e3);
+  else
+    snprintf(buf, sizeof(buf), "%.2fs", us / 1e6);
+  return buf;
+}
+
+static std::string text_report(const Snapshot *snaps, const int64_t *vals,
+                               const Memory &mem, uint64_t uptime) {
+  std::string out;
+  append(out, "uptime %llus\n\n", (unsigned long long)(uptime / 1000000));
+  append(out, "%-12s %7s %9s %9s %9s %9s\n", "stage", "count", "mean", "p50",
+         "p99", "max");
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    const Snapshot &s = snaps[i];
+    if (!s.count)
+      continue;
+    append(out, "%-12s %7llu %9s %9s %9s %9s\n", stage_names[i],
+           (unsigned long long)s.count, duration(s.sum / s.count).c_str(),
+           duration(quantile(s, 0.5)).c_str(),
+           duration(quantile(s, 0.99)).c_str(), duration(s.max).c_str());
+  }
+  out += '\n';
+  for (int i = 0; i < STAT_COUNT; i++)
+    append(out, "%-12s %lld\n", counter_names[i], (long long)vals[i]);
+  out += '\n';
+  append(out, "%-12s %llu KB\n%-12s %llu KB\n%-12s %llu KB\n%-12s %llu KB",
+         "rss", (unsigned long long)(mem.rss >> 10), "peak_rss",
+         (unsigned long long)(mem.peak_rss >> 10), "heap",
+         (unsigned long long)(mem.heap >> 10), "heap_mmap",
+         (unsigned long long)(mem.heap_mmap >> 10));
+  return out;
+}
+
+static std::string json_report(const Snapshot *snaps, const int64_t *vals,
+                               const Memory &mem, uint64_t uptime) {
+  std::string out;
+  append(out, "{\"uptime_us\":%llu,\"stages\":{",
+         (unsigned long long)uptime);
+  for (int i = 0; i < STAGE_COUNT; i++) {
+    const Snapshot &s = snaps[i];
+    append(out,
+           "%s\"%s\":{\"count\":%llu,\"sum_us\":%llu,\"max_us\":%llu,"
+           "\"p50_us\":%llu,\"p99_us\":%llu,\"buckets\":[",
+           i ? "," : "", stage_names[i], (unsigned long long)s.count,
+           (unsigned long long)s.sum, (unsigned long long)s.max,
+           (unsigned long long)quantile(s, 0.5),
+           (unsigned long long)quantile(s, 0.99));
+    // Trailing empty buckets are left out
+    int last = BUCKETS;
+    while (last > 0 && !s.buckets[last - 1])
+      last--;
+    for (int b = 0; b < last; b++)
+      append(out, "%s%llu", b ? "," : "", (unsigned long long)s.buckets[b]);
+    out += "]}";
+  }
+  out += "},\"counters\":{";
+  for (int i = 0; i < STAT_COUNT; i++)
+    append(out, "%s\"%s\":%lld", i ? "," : "", counter_names[i],
+           (long long)vals[i]);
+  append(out,
+         "},\"memory\":{\"rss_bytes\":%llu,\"peak_rss_bytes\":%llu,"
+         "\"heap_bytes\":%llu,\"heap_mmap_bytes\":%llu}}",
+         (unsigned long long)mem.rss, (unsigned long long)mem.peak_rss,
+         (unsigned long long)mem.heap, (unsigned long long)mem.heap_mmap);
+  return out;
+}
+
+std::string Stats::report(bool json) {
+  Snapshot snaps[STAGE_COUNT];
+  for (int i = 0; i < STAGE_COUNT; i++)
+    snaps[i] = snapshot(stages[i]);
+  int64_t vals[STAT_COUNT];
+  for (int i = 0; i < STAT_COUNT; i++)
+    vals[i] = counters[i].load(std::memory_order_relaxed);
+  Memory mem = memory();
+  uint64_t uptime = now_us() - started_us;
+  return json ? json_report(snaps, vals, mem, uptime)
+              : text_report(snaps, vals, mem, uptime);
+}
+
+} // namespace waul
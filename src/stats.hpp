@@ -0,0 +1,55 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+namespace waul {
+
+// Timed stages. set and configure run from the request, or the configure
+// event, to the commit; present from the commit to the frame callback.
+enum Stage {
+  STAGE_SET,
+  STAGE_CONFIGURE,
+  STAGE_PRESENT,
+  STAGE_RENDER,
+  STAGE_DECODE,
+  STAGE_COMPOSITE, // scaling is part of the same row pass
+  STAGE_RECOLOR,
+  STAGE_CACHE_FETCH,
+  STAGE_CACHE_STORE,
+  STAGE_COUNT
+};
+
+enum Counter {
+  STAT_SETS,
+  STAT_SUPERSEDED,
+  STAT_JOBS,
+  STAT_CANCELLED,
+  STAT_FRAMES, // committed
+  STAT_CACHE_HITS,
+  STAT_CACHE_MISSES, // only while the cache is on
+  STAT_PIXELS, // written into buffers
+  STAT_BUFFERS,
+  STAT_SHM_BYTES,
+  STAT_COUNT
+};
+
+// Process wide counters and log2 latency histograms. Recording is a couple
+// of relaxed atomic adds from any thread; everything else is only worked
+// out when a report is asked for.
+class Stats {
+public:
+  // Monotonic microseconds
+  static uint64_t now_us();
+  static void record(Stage s, uint64_t us);
+  // Records the time since start_us
+  static void since(Stage s, uint64_t start_us) {
+    record(s, now_us() - start_us);
+  }
+  // Counters are gauges too: buffers and their bytes also go down
+  static void add(Counter c, int64_t n = 1);
+
+  // Aligned text for people, or one JSON object
+  static std::string report(bool json);
+};
+
+} // namespace waul
@@ -0,0 +1,139 @@
+#include "thread_pool.hpp"
+#include "common.hpp"
+#include "trace.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <pthread.h>
+#include <unistd.h>
+
+namespace waul {
+
+int ThreadPool::nthreads = 1;
+
+// Workers only run pixel loops, so a small stack keeps the footprint down
+static constexpr size_t WORKER_STACK = 256 * 1024;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t run_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cv = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t done_cv = PTHREAD_COND_INITIALIZER;
+
+static pthread_t workers[ThreadPool::MAX_THREADS];
+static int nworkers = 0;
+static bool quit = false;
+
+// Current job, published under lock by bumping generation
+static void (*job_fn)(void *, int) = nullptr;
+static void *job_ctx = nullptr;
+static int job_count = 0;
+static std::atomic<int> job_next{0};
+static unsigned generation = 0;
+static int busy = 0;
+
+static void drain() {
+  int i;
+  while ((i = job_next.fetch_add(1, std::memory_order_relaxed)) < job_count)
+    job_fn(job_ctx, i);
+}
+
+// arg is the generation current at creation, so a worker that starts late
+// still picks up a job published before it first took the lock
+static void *worker_main(void *arg) {
+  unsigned seen = (unsigned)(uintptr_t)arg;
+  Trace::thread_name("worker");
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (!quit && generation == seen)
+      pthread_cond_wait(&work_cv, &lock);
+    if (quit)
+      break;
+    seen = generation;
+    pthread_mutex_unlock(&lock);
+
+    drain();
+
+    pthread_mutex_lock(&lock);
+    if (--busy == 0)
+      pthread_cond_signal(&done_cv);
+  }
+  pthread_mutex_unlock(&lock);
+  return nullptr;
+}
+
+void ThreadPool::resize(int threads) {
+  if (threads <= 0)
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  threads = std::clamp(threads, 1, MAX_THREADS);
+  if (threads == nthreads && nworkers == threads - 1)
+    return;
+
+  pthread_mutex_lock(&run_lock);
+  shutdown();
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, WORKER_STACK);
+  for (int i = 0; i < threads - 1; i++) {
+    void *arg = (void *)(uintptr_t)generation;
+    if (pthread_create(&workers[nworkers], &attr, worker_main, arg) != 0) {
+      log_msg(WARN, "Could not start render worker %d", i);
+      break;
+    }
+    nworkers++;
+  }
+  pthread_attr_destroy(&attr);
+
+  nthreads = nworkers + 1;
+  pthread_mutex_unlock(&run_lock);
+  log_msg(DEBUG, "Render threads: %d", nthreads);
+}
+
+void ThreadPool::run(int count, void (*fn)(void *ctx, int i), void *ctx) {
+  pthread_mutex_lock(&run_lock);
+  if (nworkers == 0 || count <= 1) {
+    for (int i = 0; i < count; i++)
+      fn(ctx, i);
+    pthread_mutex_unlock(&run_lock);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  job_fn = fn;
+  job_ctx = ctx;
+  job_count = count;
+  job_next.store(0, std::memory_order_relaxed);
+  busy = nworkers;
+  generation++;
+  pthread_cond_broadcast(&work_cv);
+  pthread_mutex_unlock(&lock);
+
+  drain();
+
+  pthread_mutex_lock(&lock);
+  while (busy > 0)
+    pthread_cond_wait(&done_cv, &lock);
+  job_fn = nullptr;
+  job_ctx = nullptr;
+  pthread_mutex_unlock(&lock);
+  pthread_mutex_unlock(&run_lock);
+}
+
+void ThreadPool::shutdown() {
+  pthread_mutex_lock(&lock);
+  quit = true;
+  pthread_cond_broadcast(&work_cv);
+  pthread_mutex_unlock(&lock);
+
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(workers[i], nullptr);
+
+  pthread_mutex_lock(&lock);
+  nworkers = 0;
+  nthreads = 1;
+  quit = false;
+  pthread_mutex_unlock(&lock);
+}
+
+} // namespace waul
@@ -0,0 +1,26 @@
+#pragma once
+
+namespace waul {
+
+// Small persistent worker pool. Workers block on a condition variable
+// between jobs, so an idle pool costs no CPU time.
+class ThreadPool {
+public:
+  static constexpr int MAX_THREADS = 8;
+
+  // Sets the total thread count, including the calling thread. 0 picks the
+  // number of online cores. Clamped to [1, MAX_THREADS].
+  static void resize(int threads);
+  static int size() { return nthreads; }
+
+  // Calls fn(ctx, i) for every i in [0, count) spread over the workers and
+  // the caller, and returns once all calls have finished.
+  static void run(int count, void (*fn)(void *ctx, int i), void *ctx);
+
+  static void shutdown();
+
+private:
+  static int nthreads;
+};
+
+} // namespace waul
@@ -0,0 +1,146 @@
+#include "trace.hpp"
+#include "common.hpp"
+
+#include <algorithm>
+#include <cstdio>
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace waul {
+
+// About 2 MB, allocated on the first start and kept: a thread may still be
+// writing its last span when tracing stops
+static constexpr size_t RING = 1 << 16;
+static constexpr int MAX_THREADS = 32;
+
+// seq is the event's index + 1 once it is complete, so the writer may fill
+// it in without a lock and the reader can skip one caught halfway
+struct Event {
+  std::atomic<uint64_t> seq{0};
+  const char *name;
+  uint64_t ts;
+  uint64_t dur;
+  uint32_t tid;
+};
+
+std::atomic<bool> Trace::on{false};
+
+static Event *ring = nullptr;
+static std::atomic<uint64_t> head{0};
+static std::string out_file;
+
+static pthread_mutex_t names_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct {
+  uint32_t tid;
+  const char *name;
+} names[MAX_THREADS];
+static int nnames = 0;
+
+static uint32_t current_tid() {
+  static thread_local uint32_t tid = 0;
+  if (!tid)
+    tid = (uint32_t)syscall(SYS_gettid);
+  return tid;
+}
+
+uint64_t Trace::now_us() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void Trace::span(const char *name, uint64_t begin_us) {
+  uint64_t end = now_us();
+  uint64_t i = head.fetch_add(1, std::memory_order_relaxed);
+  Event &e = ring[i % RING];
+  e.seq.store(0, std::memory_order_relaxed);
+  e.name = name;
+  e.ts = begin_us;
+  e.dur = end - begin_us;
+  e.tid = current_tid();
+  e.seq.store(i + 1, std::memory_order_release);
+}
+
+void Trace::thread_name(const char *name) {
+  uint32_t tid = current_tid();
+  pthread_mutex_lock(&names_lock);
+  int i = 0;
+  while (i < nnames && names[i].tid != tid)
+    i++;
+  if (i < MAX_THREADS) {
+    names[i] = {tid, name};
+    nnames = std::max(nnames, i + 1);
+  }
+  pthread_mutex_unlock(&names_lock);
+}
+
+bool Trace::start(const std::string &file) {
+#ifdef WAUL_NO_TRACE
+  log_msg(WARN, "Tracing was left out of this build");
+  (void)file;
+  return false;
+#else
+  if (on.load(std::memory_order_relaxed)) {
+    out_file = file;
+    return true;
+  }
+  if (!ring)
+    ring = new Event[RING];
+  for (size_t i = 0; i < RING; i++)
+    ring[i].seq.store(0, std::memory_order_relaxed);
+  head.store(0, std::memory_order_relaxed);
+  out_file = file;
+  on.store(true, std::memory_order_release);
+  log_msg(INFO, "Tracing to %s", file.c_str());
+  return true;
+#endif
+}
+
+bool Trace::stop() {
+  if (!on.exchange(false))
+    return false;
+
+  FILE *f = fopen(out_file.c_str(), "w");
+  if (!f) {
+    log_msg(WARN, "Could not write trace to %s", out_file.c_str());
+    return false;
+  }
+  int pid = getpid();
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", f);
+  bool first = true;
+  pthread_mutex_lock(&names_lock);
+  for (int i = 0; i < nnames; i++) {
+    fprintf(f,
+            "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",", pid, names[i].tid, names[i].name);
+    first = false;
+  }
+  pthread_mutex_unlock(&names_lock);
+
+  // Oldest first; once the ring wrapped only the last RING spans are left
+  uint64_t end = head.load(std::memory_order_acquire);
+  uint64_t begin = end > RING ? end - RING : 0;
+  size_t written = 0;
+  for (uint64_t i = begin; i < end; i++) {
+    const Event &e = ring[i % RING];
+    if (e.seq.load(std::memory_order_acquire) != i + 1)
+      continue;
+    fprintf(f,
+            "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,"
+            "\"pid\":%d,\"tid\":%u}",
+            first ? "" : ",", e.name, (unsigned long long)e.ts,
+            (unsigned long long)e.dur, pid, e.tid);
+    first = false;
+    written++;
+  }
+  fputs("\n]}\n", f);
+  bool ok = fclose(f) == 0;
+  log_msg(INFO, "Wrote %zu trace events to %s%s", written, out_file.c_str(),
+          end > RING ? " (oldest dropped)" : "");
+  return ok;
+}
+
+} // namespace waul
@@ -0,0 +1,60 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+namespace waul {
+
+// Timeline of spans on every thread, kept in a fixed ring in memory while
+// tracing is on and written out as Chrome trace event JSON, which
+// chrome://tracing and ui.perfetto.dev open. Off, a span costs one load
+// and a branch that is never taken. Building with WAUL_NO_TRACE
+// removes even that.
+class Trace {
+public:
+#ifdef WAUL_NO_TRACE
+  static bool enabled() { return false; }
+#else
+  static bool enabled() {
+    return __builtin_expect(on.load(std::memory_order_acquire), 0);
+  }
+#endif
+  // Starts recording; the trace is written to file by stop()
+  static bool start(const std::string &file);
+  // Writes what the ring holds and stops; false if nothing was running or
+  // the file could not be written
+  static bool stop();
+
+  // Monotonic microseconds, on the same clock as Stats::now_us()
+  static uint64_t now_us();
+  // Records name from begin_us to now. name must outlive the trace, which
+  // string literals do.
+  static void span(const char *name, uint64_t begin_us);
+  // Labels the calling thread in the trace
+  static void thread_name(const char *name);
+
+private:
+  static std::atomic<bool> on;
+};
+
+struct TraceScope {
+  const char *name;
+  uint64_t begin;
+  explicit TraceScope(const char *n)
+      : name(n), begin(Trace::enabled() ? Trace::now_us() : 0) {}
+  ~TraceScope() {
+    if (begin)
+      Trace::span(name, begin);
+  }
+};
+
+#ifdef WAUL_NO_TRACE
+#define WAUL_TRACE_SCOPE(name) ((void)0)
+#else
+#define WAUL_TRACE_CAT2(a, b) a##b
+#define WAUL_TRACE_CAT(a, b) WAUL_TRACE_CAT2(a, b)
+#define WAUL_TRACE_SCOPE(name)                                                 \
+  ::waul::TraceScope WAUL_TRACE_CAT(trace_scope_, __LINE__)(name)
+#endif
+
+} // namespace waul
@@ -0,0 +1,232 @@
+#include "wall_export.hpp"
+#include "common.hpp"
+#include "trace.hpp"
+
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace waul {
+
+// Only file and link calls run here, the fallback copy buffer is static
+static constexpr size_t EXPORT_STACK = 64 * 1024;
+
+static pthread_t export_thread;
+static bool started = false;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv = PTHREAD_COND_INITIALIZER;
+static std::string queued_path; // latest wins
+static ExportMode queued_mode = EXPORT_COPY;
+static bool queued = false, quit = false;
+
+static const char *mode_name(ExportMode mode) {
+  switch (mode) {
+  case EXPORT_HARDLINK:
+    return "hardlink";
+  case EXPORT_SYMLINK:
+    return "symlink";
+  case EXPORT_NONE:
+    return "none";
+  default:
+    return "copy";
+  }
+}
+
+// Copies record the path they were made from here, since another image
+// can have the same size and mtime
+static std::string source_record(const std::string &dst) {
+  return dst.substr(0, dst.rfind('/')) + "/.current_wall.src";
+}
+
+static std::string read_source(const std::string &dst) {
+  char buf[PATH_MAX];
+  int fd = open(source_record(dst).c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return "";
+  ssize_t n = read(fd, buf, sizeof(buf));
+  close(fd);
+  return n > 0 ? std::string(buf, n) : "";
+}
+
+static void write_source(const std::string &dst, const std::string &src) {
+  std::string file = source_record(dst), tmp = file + ".tmp";
+  int fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return;
+  bool ok = write(fd, src.data(), src.size()) == (ssize_t)src.size();
+  if (close(fd) != 0 || !ok || rename(tmp.c_str(), file.c_str()) != 0)
+    unlink(tmp.c_str());
+}
+
+// Whether dst already mirrors src (st) for mode. Copies take the source's
+// mtime and record its path, so path, size and mtime recognise one.
+static bool up_to_date(const std::string &src, const struct stat &st,
+                       const std::string &dst, ExportMode mode) {
+  if (mode == EXPORT_SYMLINK) {
+    char buf[PATH_MAX];
+    ssize_t n = readlink(dst.c_str(), buf, sizeof(buf));
+    return n == (ssize_t)src.size() && memcmp(buf, src.data(), n) == 0;
+  }
+  struct stat d;
+  if (lstat(dst.c_str(), &d) != 0 || !S_ISREG(d.st_mode))
+    return false;
+  if (mode == EXPORT_HARDLINK)
+    return d.st_dev == st.st_dev && d.st_ino == st.st_ino;
+  return d.st_size == st.st_size && d.st_mtim.tv_sec == st.st_mtim.tv_sec &&
+         d.st_mtim.tv_nsec == st.st_mtim.tv_nsec && read_source(dst) == src;
+}
+
+static bool copy_data(int in, int out, off_t size) {
+  // btrfs, XFS and bcachefs share the extents: nothing is written at all
+  if (ioctl(out, FICLONE, in) == 0)
+    return true;
+
+  // In kernel copy, server side on NFS and SMB
+  off_t done = 0;
+  while (done < size) {
+    ssize_t n = copy_file_range(in, nullptr, out, nullptr, size - done, 0);
+    if (n <= 0)
+      break;
+    done += n;
+  }
+  if (done == size)
+    return true;
+
+  // Older kernels and odd filesystems: read and write from where it stopped
+  static char buf[64 * 1024];
+  ssize_t n;
+  while ((n = read(in, buf, sizeof(buf))) > 0) {
+    for (ssize_t w = 0; w < n;) {
+      ssize_t k = write(out, buf + w, n - w);
+      if (k < 0)
+        return false;
+      w += k;
+    }
+  }
+  return n == 0;
+}
+
+static bool copy_to(int in, const struct stat &st, const std::string &tmp) {
+  int out = open(tmp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (out < 0)
+    return false;
+  bool ok = copy_data(in, out, st.st_size);
+  const timespec times[2] = {st.st_atim, st.st_mtim};
+  if (ok)
+    futimens(out, times);
+  return close(out) == 0 && ok;
+}
+
+static void export_wall(const std::string &src, ExportMode mode) {
+  if (mode == EXPORT_NONE)
+    return;
+  std::string dir = get_cache_dir();
+  std::string dst = dir + "/current_wall";
+  std::string tmp = dir + "/.current_wall.tmp";
+
+  int in = open(src.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st;
+  if (in < 0 || fstat(in, &st) != 0) {
+    log_msg(WARN, "Wallpaper does not exist: %s", src.c_str());
+    if (in >= 0)
+      close(in);
+    return;
+  }
+  if (up_to_date(src, st, dst, mode)) {
+    log_msg(DEBUG, "current_wall already mirrors %s", src.c_str());
+    close(in);
+    return;
+  }
+
+  // Built under a temporary name and renamed over, so readers see either
+  // the old file or the complete new one
+  unlink(tmp.c_str());
+  bool ok, copied = false;
+  if (mode == EXPORT_SYMLINK) {
+    ok = symlink(src.c_str(), tmp.c_str()) == 0;
+  } else if (mode == EXPORT_HARDLINK) {
+    ok = link(src.c_str(), tmp.c_str()) == 0;
+    if (!ok && errno == EXDEV) {
+      log_msg(DEBUG, "Cannot hardlink across filesystems, copying");
+      ok = copied = copy_to(in, st, tmp);
+    }
+  } else {
+    ok = copied = copy_to(in, st, tmp);
+  }
+  close(in);
+
+  // Gone before the new file lands, so a crash in between only costs a copy
+  unlink(source_record(dst).c_str());
+  if (ok && rename(tmp.c_str(), dst.c_str()) == 0) {
+    if (copied)
+      write_source(dst, src);
+    log_msg(DEBUG, "Exported %s as current_wall (%s)", src.c_str(),
+            mode_name(mode));
+  } else {
+    log_msg(WARN, "Could not export current_wall: %s", strerror(errno));
+    unlink(tmp.c_str());
+  }
+}
+
+static void *export_main(void *) {
+  Trace::thread_name("export");
+  pthread_mutex_lock(&lock);
+  while (true) {
+    while (!quit && !queued)
+      pthread_cond_wait(&cv, &lock);
+    if (quit)
+      break;
+    std::string path = queued_path;
+    ExportMode mode = queued_mode;
+    queued = false;
+    pthread_mutex_unlock(&lock);
+
+    {
+      WAUL_TRACE_SCOPE("export");
+      export_wall(path, mode);
+    }
+
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return nullptr;
+}
+
+void WallExport::request(const std::string &path, ExportMode mode) {
+  if (mode == EXPORT_NONE)
+    return;
+  pthread_mutex_lock(&lock);
+  if (!started) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, EXPORT_STACK);
+    started = pthread_create(&export_thread, &attr, export_main, nullptr) == 0;
+    pthread_attr_destroy(&attr);
+  }
+  queued_path = path;
+  queued_mode = mode;
+  queued = true;
+  pthread_cond_signal(&cv);
+  pthread_mutex_unlock(&lock);
+  if (!started)
+    log_msg(WARN, "Could not start the current_wall export thread");
+}
+
+void WallExport::shutdown() {
+  if (!started)
+    return;
+  pthread_mutex_lock(&lock);
+  quit = true;
+  pthread_cond_signal(&cv);
+  pthread_mutex_unlock(&lock);
+  pthread_join(export_thread, nullptr);
+  started = false;
+}
+
+} // namespace waul
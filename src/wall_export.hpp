@@ -0,0 +1,18 @@
+#pragma once
+#include "config.hpp"
+#include <string>
+
+namespace waul {
+
+// Mirrors the wallpaper as get_cache_dir()/current_wall for other programs
+// (lock screens, theming scripts). Exports run on their own thread, newest
+// request first, and replace the file atomically, so readers never see a
+// partial image and the main loop never waits on disk.
+class WallExport {
+public:
+  static void request(const std::string &path, ExportMode mode);
+  // Finishes the export in progress, drops any queued one
+  static void shutdown();
+};
+
+} // namespace waul
@@ -1,8 +1,15 @@
 #include "wayland_backend.hpp"
 #include "common.hpp"
 #include "config.hpp"
+#include "event_loop.hpp"
 #include "ipc.hpp"
+#include "palette.hpp"
 #include "renderer.hpp"
+#include "slideshow.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "trace.hpp"
+#include "wall_export.hpp"
 
 #include <wayland-client.h>
 
@@ -12,12 +19,13 @@
 
 #include <cstdio>
 #include <cstring>
-#include <filesystem>
-#include <poll.h>
+#include <algorithm>
+#include <sys/epoll.h>
 #include <string>
 #include <unistd.h>
+#include <utility>
+#include <vector>
 
-namespace fs = std::filesystem;
 namespace waul {
 
 bool Wayland::running = false;
@@ -27,11 +35,42 @@ static wl_display *display;
 static wl_compositor *compositor;
 static wl_shm *shm;
 static zwlr_layer_shell_v1 *layer_shell;
-static wl_surface *surface;
-static zwlr_layer_surface_v1 *layer_surface;
+
+// One background layer surface per monitor
+struct Output {
+  uint32_t name = 0;
+  uint32_t version = 0;
+  wl_output *wl = nullptr;
+  zwlr_layer_surface_v1 *layer = nullptr;
+  Target target;
+  int pending_w = 0, pending_h = 0;
+  bool dirty = false; // configured to a size the buffers do not have yet
+  uint64_t configured_us = 0;
+};
+
+static std::vector<Output *> outputs;
+static bool surfaces_ready = false;
+
+static void output_create_surface(Output *o);
+
+static void output_destroy(Output *o) {
+  Renderer::detach(&o->target);
+  Renderer::destroy_pool(o->target.pool);
+  if (o->layer)
+    zwlr_layer_surface_v1_destroy(o->layer);
+  if (o->target.surf)
+    wl_surface_destroy(o->target.surf);
+  if (o->wl) {
+    if (o->version >= 3)
+      wl_output_release(o->wl);
+    else
+      wl_output_destroy(o->wl);
+  }
+  delete o;
+}
 
 static void registry_add(void *, wl_registry *reg, uint32_t name,
-                         const char *iface, uint32_t) {
+                         const char *iface, uint32_t version) {
   if (strcmp(iface, wl_compositor_interface.name) == 0)
     compositor = (wl_compositor *)wl_registry_bind(reg, name,
                                                    &wl_compositor_interface, 4);
@@ -40,31 +79,135 @@ static void registry_add(void *, wl_registry *reg, uint32_t name,
   else if (strcmp(iface, zwlr_layer_shell_v1_interface.name) == 0)
     layer_shell = (zwlr_layer_shell_v1 *)wl_registry_bind(
         reg, name, &zwlr_layer_shell_v1_interface, 1);
+  else if (strcmp(iface, wl_output_interface.name) == 0) {
+    Output *o = new Output;
+    o->name = name;
+    o->version = std::min(version, 3u);
+    o->wl = (wl_output *)wl_registry_bind(reg, name, &wl_output_interface,
+                                          o->version);
+    outputs.push_back(o);
+    log_msg(INFO, "Output %u added", name);
+    // Hotplugged after startup: give it a surface right away
+    if (surfaces_ready)
+      output_create_surface(o);
+  }
+}
+
+static void registry_remove(void *, wl_registry *, uint32_t name) {
+  for (size_t i = 0; i < outputs.size(); i++) {
+    if (outputs[i]->name == name) {
+      log_msg(INFO, "Output %u removed", name);
+      output_destroy(outputs[i]);
+      outputs.erase(outputs.begin() + i);
+      return;
+    }
+  }
 }
 
-static const wl_registry_listener reg_listener = {
-    .global = registry_add,
-    .global_remove = [](void *, wl_registry *, uint32_t) {}};
+static const wl_registry_listener reg_listener = {.global = registry_add,
+                                                  .global_remove =
+                                                      registry_remove};
 
-static void layer_surface_configure(void *, struct zwlr_layer_surface_v1 *ls,
+static void layer_surface_configure(void *data,
+                                    struct zwlr_layer_surface_v1 *ls,
                                     uint32_t serial, uint32_t w, uint32_t h) {
+  WAUL_TRACE_SCOPE("configure");
+  Output *o = (Output *)data;
   zwlr_layer_surface_v1_ack_configure(ls, serial);
   if (w == 0)
     w = 1920;
   if (h == 0)
     h = 1080;
 
-  // Only resize if actual dimensions changed
-  const auto &buf = Renderer::get_buffer();
-  if (buf.w != (int)w || buf.h != (int)h) {
-    Renderer::resize_buffer(w, h);
-    Renderer::draw(Wayland::get_current_wallpaper(), surface);
+  // Only redraw if actual dimensions changed; the draw itself is batched
+  // so outputs configured together share one decode
+  const auto &pool = o->target.pool;
+  if (pool.w != (int)w || pool.h != (int)h) {
+    o->pending_w = w;
+    o->pending_h = h;
+    if (!o->dirty)
+      o->configured_us = Stats::now_us();
+    o->dirty = true;
   }
 }
 
+static void layer_surface_closed(void *data, struct zwlr_layer_surface_v1 *) {
+  Output *o = (Output *)data;
+  Renderer::detach(&o->target);
+  Renderer::destroy_pool(o->target.pool);
+  zwlr_layer_surface_v1_destroy(o->layer);
+  wl_surface_destroy(o->target.surf);
+  o->layer = nullptr;
+  o->target.surf = nullptr;
+  o->dirty = false;
+}
+
 static const struct zwlr_layer_surface_v1_listener layer_surface_listener = {
-    .configure = layer_surface_configure,
-    .closed = [](void *, auto *) { Wayland::stop(); }};
+    .configure = layer_surface_configure, .closed = layer_surface_closed};
+
+static void output_create_surface(Output *o) {
+  o->target.surf = wl_compositor_create_surface(compositor);
+  o->layer = zwlr_layer_shell_v1_get_layer_surface(
+      layer_shell, o->target.surf, o->wl, ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND,
+      "waul-wallpaper");
+
+  zwlr_layer_surface_v1_add_listener(o->layer, &layer_surface_listener, o);
+  zwlr_layer_surface_v1_set_anchor(o->layer, 15); // All 4 sides
+  zwlr_layer_surface_v1_set_exclusive_zone(o->layer, -1);
+  wl_surface_commit(o->target.surf);
+}
+
+// A wallpaper to draw and the clients to tell once it is on screen. since
+// is when it was asked for, or for resizes when the first output was
+// configured.
+struct Request {
+  std::string path;
+  std::vector<IpcTicket> waiting;
+  bool preload = false;
+  bool resize = false;
+  bool catch_up = false; // outputs a job had to leave out; not timed
+  uint64_t since_us = 0;
+};
+
+// Latest wins: a newer wallpaper replaces the one waiting here, so a burst
+// of sets costs one render per presented frame, not one per set
+static Request pending;
+static bool has_pending = false;
+// Same for preloads, which only run when no set is waiting
+static Request pending_preload;
+static bool has_preload = false;
+// What the running job draws, valid while inflight_id is set
+static Request inflight;
+static uint64_t inflight_id = 0;
+// Preloads are dropped once the running job no longer uses them
+static bool drop_after = false;
+// Last wallpaper announced to subscribers
+static std::string shown;
+
+static void answer(Request &r, IpcStatus status, const char *text) {
+  for (const IpcTicket &t : r.waiting)
+    ipc_reply(t, status, text);
+  r.waiting.clear();
+}
+
+// Resizes and redraws every output with a pending configure in one pass.
+// since_us becomes the oldest of their configure events.
+static uint64_t draw_dirty_outputs(uint64_t &since_us) {
+  std::vector<Target *> targets;
+  for (Output *o : outputs) {
+    if (!o->dirty || !o->target.surf)
+      continue;
+    o->dirty = false;
+    if (targets.empty() || o->configured_us < since_us)
+      since_us = o->configured_us;
+    Renderer::resize_pool(o->target.pool, o->pending_w, o->pending_h);
+    targets.push_back(&o->target);
+  }
+  if (targets.empty())
+    return 0;
+  return Renderer::submit(Wayland::get_current_wallpaper(), targets.data(),
+                          targets.size());
+}
 
 int Wayland::init() {
   display = wl_display_connect(nullptr);
@@ -84,17 +227,11 @@ int Wayland::init() {
   }
 
   Renderer::init(shm);
+  Config::load();
 
-  surface = wl_compositor_create_surface(compositor);
-  layer_surface = zwlr_layer_shell_v1_get_layer_surface(
-      layer_shell, surface, nullptr, ZWLR_LAYER_SHELL_V1_LAYER_BACKGROUND,
-      "waul-wallpaper");
-
-  zwlr_layer_surface_v1_add_listener(layer_surface, &layer_surface_listener,
-                                     nullptr);
-  zwlr_layer_surface_v1_set_anchor(layer_surface, 15); // All 4 sides
-  zwlr_layer_surface_v1_set_exclusive_zone(layer_surface, -1);
-  wl_surface_commit(surface);
+  for (Output *o : outputs)
+    output_create_surface(o);
+  surfaces_ready = true;
   wl_display_flush(display);
 
   // Load last wallpaper
@@ -108,13 +245,148 @@ int Wayland::init() {
   }
 
   running = true;
-  log_msg(SUCCESS, "Wayland backend initialized");
+  log_msg(SUCCESS, "Wayland backend initialized (%zu outputs)",
+          outputs.size());
   return 1;
 }
 
 void Wayland::stop() { running = false; }
 
-void Wayland::set_wallpaper(const std::string &path) {
+// Draws path on every configured output with the current config
+static uint64_t draw_all_outputs(const std::string &path) {
+  std::vector<Target *> targets;
+  for (Output *o : outputs) {
+    if (o->target.surf && !o->dirty)
+      targets.push_back(&o->target);
+  }
+  return Renderer::submit(path, targets.data(), targets.size());
+}
+
+// Outputs left out of the last job because every buffer was still held,
+// once the compositor has released one
+static uint64_t draw_starved_outputs() {
+  std::vector<Target *> targets;
+  for (Output *o : outputs) {
+    if (o->target.surf && !o->dirty && o->target.starved &&
+        Renderer::has_free_slot(o->target.pool))
+      targets.push_back(&o->target);
+  }
+  if (targets.empty())
+    return 0;
+  return Renderer::submit(Wayland::get_current_wallpaper(), targets.data(),
+                          targets.size());
+}
+
+static void request(const std::string &path, const IpcTicket &ticket) {
+  if (has_pending && pending.path != path) {
+    log_msg(DEBUG, "Superseded before drawing: %s", pending.path.c_str());
+    answer(pending, IPC_SUPERSEDED, "superseded");
+    Stats::add(STAT_SUPERSEDED);
+  }
+  if (!has_pending || pending.path != path)
+    pending.since_us = Stats::now_us();
+  pending.path = path;
+  if (ticket.client)
+    pending.waiting.push_back(ticket);
+  has_pending = true;
+
+  // Whatever the running job draws would only be replaced right away
+  if (inflight_id && inflight.path != path)
+    Renderer::cancel();
+}
+
+static std::vector<Target *> live_targets() {
+  std::vector<Target *> targets;
+  for (Output *o : outputs) {
+    if (o->target.surf)
+      targets.push_back(&o->target);
+  }
+  return targets;
+}
+
+static void release_preloads() {
+  auto targets = live_targets();
+  size_t freed = Renderer::drop_preloads(targets.data(), targets.size());
+  if (freed)
+    log_msg(INFO, "Dropped preloaded frames (%zu MB)", freed >> 20);
+}
+
+// Starts the next job once the renderer is free. Resizes go first: buffers
+// can only be reallocated while nothing renders into them.
+static void pump() {
+  if (Renderer::busy())
+    return;
+  uint64_t configured_us = 0;
+  if ((inflight_id = draw_dirty_outputs(configured_us))) {
+    inflight = Request{Wayland::get_current_wallpaper(), {}};
+    inflight.resize = true;
+    inflight.since_us = configured_us;
+    return;
+  }
+  if (has_pending) {
+    inflight = std::move(pending);
+    pending = Request();
+    has_pending = false;
+    if (!(inflight_id = draw_all_outputs(inflight.path)))
+      answer(inflight, IPC_OK, "ok"); // already on screen
+    return;
+  }
+  if ((inflight_id = draw_starved_outputs())) {
+    inflight = Request{Wayland::get_current_wallpaper(), {}};
+    inflight.catch_up = true;
+    return;
+  }
+  if (has_preload) {
+    inflight = std::move(pending_preload);
+    pending_preload = Request();
+    has_preload = false;
+    auto targets = live_targets();
+    inflight_id = Renderer::submit(inflight.path, targets.data(),
+                                   targets.size(), true);
+    if (!inflight_id)
+      answer(inflight, IPC_OK, "ok"); // already ready
+  }
+}
+
+static void finish_job() {
+  bool cancelled = false;
+  if (!Renderer::complete(&cancelled))
+    return;
+  inflight_id = 0;
+  if (drop_after) {
+    drop_after = false;
+    release_preloads();
+    if (inflight.preload) {
+      answer(inflight, IPC_DROPPED, "dropped");
+      return;
+    }
+  }
+  if (cancelled && inflight.preload && !has_preload) {
+    // Made way for a set; tried again once that is on screen
+    pending_preload = std::move(inflight);
+    inflight = Request();
+    has_preload = true;
+    return;
+  }
+  if (cancelled) {
+    log_msg(DEBUG, "Superseded while drawing: %s", inflight.path.c_str());
+    answer(inflight, IPC_SUPERSEDED, "superseded");
+    Stats::add(STAT_SUPERSEDED);
+    return;
+  }
+  if (!inflight.preload && !inflight.catch_up)
+    Stats::since(inflight.resize ? STAGE_CONFIGURE : STAGE_SET,
+                 inflight.since_us);
+  answer(inflight, IPC_OK, "ok");
+  // Subscribers hear about it once it is actually on screen
+  if (!inflight.preload && inflight.path != shown) {
+    shown = inflight.path;
+    PaletteCache::show(shown);
+    ipc_broadcast("wallpaper", shown);
+  }
+}
+
+void Wayland::set_wallpaper(const std::string &path, const IpcTicket &ticket) {
   current_wall = path;
   std::string cache_dir = get_cache_dir();
   // Save to cache
@@ -125,71 +397,154 @@ void Wayland::set_wallpaper(const std::string &path) {
     fclose(f);
   }
 
-  // support for wallpaper sync from a wallpaper path
-  fs::path source_path(path);
+  // support for wallpaper sync from a wallpaper path; other apps detect
+  // the image format from file headers
+  WallExport::request(path, Config::get().wall_export);
 
-  if (fs::exists(source_path)) {
-    // let other apps detect the image format from file headers
-    fs::path target_path = fs::path(cache_dir) / ("current_wall");
-    for (const auto &entry : fs::directory_iterator(cache_dir)) {
-      if (entry.is_regular_file() && entry.path().stem() == "current_wall") {
-        fs::remove(entry.path());
-      }
-    }
-    fs::copy_file(source_path, target_path,
-                  fs::copy_options::overwrite_existing);
-  } else {
-    log_msg(ERROR, "Wallpaper does not exist: %s", path.c_str());
+  Stats::add(STAT_SETS);
+  request(path, ticket);
+  log_msg(INFO, "Wallpaper queued: %s", path.c_str());
+}
+
+void Wayland::preload(const std::string &path, const IpcTicket &ticket) {
+  // Sized for what the outputs are about to show
+  size_t need = 0;
+  for (Output *o : outputs) {
+    if (o->target.surf)
+      need += (size_t)std::max(o->pending_w, o->target.pool.w) *
+              std::max(o->pending_h, o->target.pool.h) * 4;
+  }
+  size_t limit = (size_t)Config::get().preload_mb << 20;
+  if (need > limit) {
+    log_msg(WARN, "Preload of %s needs %zu MB, preload_limit is %d MB",
+            path.c_str(), need >> 20, Config::get().preload_mb);
+    ipc_reply(ticket, IPC_ERR_LIMIT, "over preload_limit");
+    return;
   }
 
-  Renderer::draw(current_wall, surface);
-  log_msg(INFO, "Wallpaper set: %s", path.c_str());
+  if (has_preload && pending_preload.path != path)
+    answer(pending_preload, IPC_SUPERSEDED, "superseded");
+  pending_preload.path = path;
+  pending_preload.preload = true;
+  if (ticket.client)
+    pending_preload.waiting.push_back(ticket);
+  has_preload = true;
+  log_msg(INFO, "Preload queued: %s", path.c_str());
+}
+
+void Wayland::drop_preloads() {
+  answer(pending_preload, IPC_DROPPED, "dropped");
+  pending_preload = Request();
+  has_preload = false;
+  if (inflight_id) {
+    // The running job may be attaching one of them
+    if (inflight.preload)
+      Renderer::cancel();
+    drop_after = true;
+    return;
+  }
+  release_preloads();
 }
 
 std::string Wayland::get_current_wallpaper() { return current_wall; }
 
+static int config_watch = -1;
+static bool slideshow_watched = false;
+// The display fd is prepared for reading before each wait and read by its
+// handler; if it did not fire the read is cancelled
+static bool display_prepared = false;
+
+static void on_display(void *, uint32_t events) {
+  if (!display_prepared)
+    return;
+  display_prepared = false;
+  if (!(events & EPOLLIN)) {
+    wl_display_cancel_read(display);
+  } else if (wl_display_read_events(display) < 0) {
+    log_msg(ERROR, "Lost the Wayland connection");
+    Wayland::stop();
+    return;
+  }
+  if (events & (EPOLLHUP | EPOLLERR)) {
+    log_msg(ERROR, "Wayland display hung up");
+    Wayland::stop();
+  }
+}
+
+static void on_slideshow(void *, uint32_t) { Slideshow::tick(); }
+
+// The timerfd only exists once a slideshow has been configured
+static void configure_slideshow() {
+  Slideshow::configure(Config::get());
+  if (!slideshow_watched && Slideshow::timer_fd() >= 0)
+    slideshow_watched =
+        EventLoop::add(Slideshow::timer_fd(), EPOLLIN, on_slideshow, nullptr);
+}
+
+static void on_config(void *, uint32_t) {
+  if (!Config::watch_pending(config_watch))
+    return;
+  if (Config::load())
+    request(Wayland::get_current_wallpaper(), {});
+  configure_slideshow();
+}
+
+// Committed here, on the thread that owns the Wayland objects
+static void on_render_done(void *, uint32_t) { finish_job(); }
+
 void Wayland::run() {
-  int ipc_sock = ipc_server_init();
-  if (ipc_sock < 0)
+  if (ipc_server_init() < 0)
     return;
+  Trace::thread_name("main");
 
-  struct pollfd fds[2];
-  fds[0].fd = wl_display_get_fd(display);
-  fds[0].events = POLLIN;
-  fds[1].fd = ipc_sock;
-  fds[1].events = POLLIN;
+  config_watch = Config::watch();
+  EventLoop::add(config_watch, EPOLLIN, on_config, nullptr);
+  EventLoop::add(Renderer::event_fd(), EPOLLIN, on_render_done, nullptr);
+  EventLoop::add(wl_display_get_fd(display), EPOLLIN, on_display, nullptr);
+  configure_slideshow();
 
   log_msg(INFO, "Entering main loop");
 
   while (running) {
+    wl_display_dispatch_pending(display);
+    pump();
+    ipc_collect();
+
     while (wl_display_prepare_read(display) != 0)
       wl_display_dispatch_pending(display);
     wl_display_flush(display);
+    display_prepared = true;
 
-    if (poll(fds, 2, -1) < 0) {
+    // Wakes up for the pacing deadline only while a commit is unpresented
+    bool ok = EventLoop::wait(Renderer::poll_timeout());
+    if (display_prepared) {
+      display_prepared = false;
       wl_display_cancel_read(display);
-      break;
-    }
-
-    if (fds[0].revents & POLLIN) {
-      wl_display_read_events(display);
-      wl_display_dispatch_pending(display);
-    } else {
-      wl_display_cancel_read(display);
-    }
-
-    if (fds[1].revents & POLLIN) {
-      int client = ipc_server_accept(ipc_sock);
-      if (client >= 0)
-        ipc_handle_client(client);
     }
+    if (!ok)
+      break;
   }
 
-  Renderer::cleanup();
-  close(ipc_sock);
+  Renderer::shutdown();
+  WallExport::shutdown();
+  Trace::stop();
+  answer(pending, IPC_ERR_EXITING, "daemon exiting");
+  answer(pending_preload, IPC_ERR_EXITING, "daemon exiting");
+  answer(inflight, IPC_ERR_EXITING, "daemon exiting");
+
+  for (Output *o : outputs)
+    output_destroy(o);
+  outputs.clear();
+  ThreadPool::shutdown();
+  if (config_watch >= 0) {
+    EventLoop::remove(config_watch);
+    close(config_watch);
+  }
+  ipc_shutdown();
   unlink(get_socket_path().c_str());
   if (display)
     wl_display_disconnect(display);
+  EventLoop::shutdown();
   log_msg(INFO, "Daemon exit");
 }
 
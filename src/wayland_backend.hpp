@@ -1,4 +1,5 @@
 #pragma once
+#include "ipc.hpp"
 #include <string>
 
 namespace waul {
@@ -8,7 +9,14 @@ public:
   static int init();
   static void run();
   static void stop();
-  static void set_wallpaper(const std::string &path);
+  // Queues path for drawing. ticket, if given, is answered once the
+  // wallpaper is on screen, or superseded by a newer one.
+  static void set_wallpaper(const std::string &path,
+                            const IpcTicket &ticket = {});
+  // Renders path for the current outputs and config into a spare buffer,
+  // so a later set of it only swaps buffers. Answers like set_wallpaper.
+  static void preload(const std::string &path, const IpcTicket &ticket = {});
+  static void drop_preloads();
   static std::string get_current_wallpaper();
 
 private: